@@ -28,6 +28,10 @@
 #include <assert.h>
 #include <signal.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <json-c/json.h>
 
@@ -48,12 +52,21 @@
  */
 static const char _all_[]       = "all";
 static const char _applstchg_[] = "application-list-changed";
+static const char _appstarted_[] = "app-started";
+static const char _appstopped_[] = "app-stopped";
+static const char _appfailed_[] = "app-failed";
 static const char _bad_request_[] = "bad-request";
 static const char _cannot_start_[] = "cannot-start";
 static const char _detail_[]    = "detail";
 static const char _forbidden_[] = "insufficient-scope";
+static const char _generation_[] = "generation";
+static const char _error_[]     = "error";
+static const char _fields_[]    = "fields";
+static const char _filter_[]    = "filter";
 static const char _id_[]	= "id";
+static const char _ids_[]       = "ids";
 static const char _not_found_[] = "not-found";
+static const char _not_modified_[] = "not-modified";
 static const char _not_running_[] = "not-running";
 static const char _once_[]      = "once";
 static const char _pause_[]     = "pause";
@@ -62,7 +75,9 @@ static const char _runid_[]     = "runid";
 static const char _runnables_[] = "runnables";
 static const char _runners_[]   = "runners";
 static const char _start_[]     = "start";
+static const char _start_many_[] = "start-many";
 static const char _state_[]     = "state";
+static const char _stats_[]     = "stats";
 static const char _terminate_[] = "terminate";
 static const char _uid_[]       = "uid";
 static const char _update_[]    = "update";
@@ -90,6 +105,11 @@ static const char _update_[]    = "update";
 #define ADD_AGL_PERMISSIONS 1
 #endif
 
+/* path of the snapshot of the application database, NULL for none */
+#if !defined(AFM_UDB_SNAPSHOT)
+#define AFM_UDB_SNAPSHOT NULL
+#endif
+
 #if ADD_AGL_PERMISSIONS
 
 #  define AGL_PREFIX     "urn:AGL:permission:afm:system:"
@@ -126,7 +146,9 @@ enum {
 	Param_UID    = 1,  /* the UID is set for the request */
 	Param_All    = 2,  /* get even hidden items */
 	Param_Id     = 4,  /* the id of an application */
-	Param_RunId  = 8   /* the pid of a process*/
+	Param_RunId  = 8,  /* the pid of a process*/
+	Param_Generation = 16, /* the generation known by the client */
+	Param_Ids    = 32  /* an array of ids of applications */
 };
 
 /**
@@ -155,14 +177,22 @@ struct params {
 	int uid;
 	/** value of param 'runid' if set */
 	int runid;
+	/** value of param 'generation' if set */
+	unsigned generation;
 	/** value of param 'id' if set */
 	const char *id;
+	/** array value of param 'ids' if set */
+	struct json_object *ids;
 	/** object value of parameters */
 	struct json_object *args;
 	/** the request */
 	afb_req_t req;
 	/** processing function */
 	void (*action)(afb_req_t, const struct params *);
+	/** is the action to be done in the event loop? */
+	int inloop;
+	/** next action queued for the event loop */
+	struct params *next;
 };
 
 /*
@@ -170,11 +200,29 @@ struct params {
  */
 static struct afm_udb *afudb;
 
+/*
+ * The actions using systemd are queued for being done in the event loop
+ * because the buses of the binder and the table of runners of afm-urun
+ * are not thread safe. Other actions are done in any thread.
+ */
+static pthread_mutex_t loop_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct params *loop_head;
+static struct params **loop_tail = &loop_head;
+static int loop_fd = -1;
+static volatile sig_atomic_t loop_sighup;
+
 /*
  * the event signaling that application list changed
  */
 static afb_event_t applist_changed_event;
 
+/*
+ * the events signaling the lifecycle of applications
+ */
+static afb_event_t app_started_event;
+static afb_event_t app_stopped_event;
+static afb_event_t app_failed_event;
+
 /*
  * creates the data handling the given JSON object
  */
@@ -184,6 +232,18 @@ static int json2data(afb_data_t *data, struct json_object *object)
 			object, 0, (void*)json_object_put, object);
 }
 
+/*
+ * creates the data handling the given JSON serialization,
+ * a shared text of afm-udb whose reference is transferred to the data
+ */
+static int text2data(afb_data_t *data, struct afm_udb_text *text)
+{
+	return afb_create_data_raw(data, AFB_PREDEFINED_TYPE_JSON,
+			afm_udb_text_string(text),
+			1 + afm_udb_text_length(text),
+			(void*)afm_udb_text_unref, text);
+}
+
 /* extract the json object of the request */
 static struct json_object *get_json_object(afb_req_t req)
 {
@@ -261,6 +321,26 @@ static void cant_start(afb_req_t req)
 	reply_error(req, _cannot_start_, AFB_ERRNO_INTERNAL_ERROR);
 }
 
+/* reply the error of 'errno' after a failed start */
+static void reply_errno(afb_req_t req)
+{
+	switch (errno) {
+	case ENOMEM:
+		out_of_memory(req);
+		break;
+	case ENOENT:
+		not_found(req);
+		break;
+	case EPERM:
+	case EACCES:
+		forbidden_request(req);
+		break;
+	default:
+		cant_start(req);
+		break;
+	}
+}
+
 /* callback for has_auth */
 static void has_auth_cb(void *closure, int status, void *extra)
 {
@@ -284,17 +364,43 @@ static void has_auth(
 
 /*
  * Broadcast the event "application-list-changed".
- * This event is sent when SIGHUP is received
+ * This event is sent when the list of applications changed.
+ * It tells the new generation of the applications.
+ * When not NULL, 'changes' is the object describing the ids of the
+ * applications 'added', 'removed' and 'modified'. Its fields are
+ * copied to the event.
  */
-static void application_list_changed(const char *operation, const char *data)
+static void application_list_changed(const char *operation, const char *data, struct json_object *changes)
 {
 	afb_data_t ada;
 	struct json_object *e = NULL;
-	rp_jsonc_pack(&e, "{ss ss}", "operation", operation, "data", data);
+	struct json_object_iter i;
+
+	rp_jsonc_pack(&e, "{ss ss sI}", "operation", operation, "data", data,
+				_generation_, (int64_t)afm_udb_generation(afudb));
+	if (e && changes) {
+		json_object_object_foreachC(changes, i)
+			json_object_object_add(e, i.key, json_object_get(i.val));
+	}
 	json2data(&ada, e);
 	afb_event_broadcast(applist_changed_event, 1, &ada);
 }
 
+/*
+ * Broadcast the events "app-started", "app-stopped" or "app-failed"
+ * with the description 'desc' of the runner.
+ */
+static void application_lifecycle(void *closure, enum SysD_State state, struct json_object *desc)
+{
+	afb_data_t ada;
+	afb_event_t event;
+
+	event = state == SysD_State_Active ? app_started_event
+		: state == SysD_State_Failed ? app_failed_event : app_stopped_event;
+	if (json2data(&ada, json_object_get(desc)) >= 0)
+		afb_event_broadcast(event, 1, &ada);
+}
+
 /**
  * get the uid of the request
  */
@@ -348,6 +454,14 @@ static void extract_params(
 		}
 	}
 
+	/* args is an array value: ids of applications */
+	else if (json_object_is_type(args, json_type_array)) {
+		if (expected & Param_Ids) {
+			params->ids = args;
+			found |= Param_Ids;
+		}
+	}
+
 	/* args is a object value: inspect it */
 	else if (json_object_is_type(args, json_type_object)) {
 		/* get UID */
@@ -380,6 +494,28 @@ static void extract_params(
 			}
 		}
 
+		/* get ids */
+		if ((expected & Param_Ids)
+		&& json_object_object_get_ex(args, _ids_, &obj)) {
+			if (!json_object_is_type(obj, json_type_array))
+				status = error_bad_request;
+			else {
+				params->ids = obj;
+				found |= Param_Ids;
+			}
+		}
+
+		/* get generation */
+		if ((expected & Param_Generation)
+		&& json_object_object_get_ex(args, _generation_, &obj)) {
+			if (!json_object_is_type(obj, json_type_int))
+				status = error_bad_request;
+			else {
+				params->generation = (unsigned)json_object_get_int64(obj);
+				found |= Param_Generation;
+			}
+		}
+
 		/* get runid */
 		if (expected & Param_RunId) {
 			if (json_object_object_get_ex(args, _runid_, &obj)) {
@@ -454,13 +590,50 @@ static void check_runid(struct params *params)
 	check_final(params);
 }
 
+/* queue, if needed, the end of the processing for the event loop */
+static void check_loop(struct params *params)
+{
+	uint64_t one = 1;
+	struct params **prv;
+	afb_req_t req;
+	int found;
+
+	if (params->status != no_error || !params->inloop)
+		check_runid(params);
+	else {
+		req = afb_req_addref(params->req);
+		pthread_mutex_lock(&loop_mutex);
+		*loop_tail = params;
+		loop_tail = &params->next;
+		pthread_mutex_unlock(&loop_mutex);
+		if (write(loop_fd, &one, sizeof one) < 0) {
+			RP_ERROR("can't wake up the event loop: %m");
+			/* unqueue the request unless an other wake up took it */
+			pthread_mutex_lock(&loop_mutex);
+			for (prv = &loop_head ; *prv != NULL && *prv != params ; prv = &(*prv)->next);
+			found = *prv != NULL;
+			if (found) {
+				*prv = params->next;
+				if (loop_tail == &params->next)
+					loop_tail = prv;
+			}
+			pthread_mutex_unlock(&loop_mutex);
+			if (found) {
+				free(params);
+				reply_error(req, NULL, AFB_ERRNO_INTERNAL_ERROR);
+				afb_req_unref(req);
+			}
+		}
+	}
+}
+
 /* check, if needed, that permission view-all is granted */
 static void check_permission_all(struct params *params)
 {
 	if (params->status != no_error || !(params->found & Param_All))
-		check_runid(params);
+		check_loop(params);
 	else
-		has_auth(params, &auth_perm_view_all, check_runid);
+		has_auth(params, &auth_perm_view_all, check_loop);
 }
 
 /* check, if needed, that permission set-uid is granted */
@@ -473,8 +646,8 @@ static void check_permission_uid(struct params *params)
 }
 
 /* compute the parameters, check it and then if correct perform the action */
-static void with_params(afb_req_t req, unsigned required, unsigned optional,
-		void (*action)(afb_req_t req, const struct params *params))
+static void with_params_ex(afb_req_t req, unsigned required, unsigned optional,
+		void (*action)(afb_req_t req, const struct params *params), int inloop)
 {
 	struct params *params = calloc(1, sizeof *params);
 	if (params == NULL)
@@ -483,27 +656,184 @@ static void with_params(afb_req_t req, unsigned required, unsigned optional,
 		params->required = required;
 		params->req = req;
 		params->action = action;
+		params->inloop = inloop;
 		extract_params(params, optional);
 		check_permission_uid(params);
 	}
 }
 
+/* same as with_params_ex for actions not using systemd */
+static void with_params(afb_req_t req, unsigned required, unsigned optional,
+		void (*action)(afb_req_t req, const struct params *params))
+{
+	with_params_ex(req, required, optional, action, 0);
+}
+
+/* same as with_params_ex for actions using systemd */
+static void with_params_in_loop(afb_req_t req, unsigned required, unsigned optional,
+		void (*action)(afb_req_t req, const struct params *params))
+{
+	with_params_ex(req, required, optional, action, 1);
+}
+
+/*
+ * Is the request 'req' for a batch of ids, either an array or
+ * an object with the field "ids"?
+ */
+static int is_batch(afb_req_t req)
+{
+	struct json_object *args = get_json_object(req);
+
+	return json_object_is_type(args, json_type_array)
+		|| (json_object_is_type(args, json_type_object)
+		 && json_object_object_get_ex(args, _ids_, NULL));
+}
+
+/*
+ * Replies to a conditional query, a query giving the generation
+ * of the data it knows. If the generation of the database is the same,
+ * the reply is the string "not-modified". Otherwise, the reply is 'text',
+ * data of serialized JSON whose reference is transferred.
+ * In both cases, the current generation is given as second reply.
+ * For unconditional queries, the reply is just 'text'.
+ */
+static void reply_conditional_data(afb_req_t req, const struct params *params, afb_data_t text, unsigned generation)
+{
+	afb_data_t data[2];
+
+	if (!(params->found & Param_Generation))
+		afb_req_reply(req, 0, 1, &text);
+	else {
+		if (params->generation != generation)
+			data[0] = text;
+		else {
+			afb_data_unref(text);
+			json2data(&data[0], json_object_new_string(_not_modified_));
+		}
+		json2data(&data[1], json_object_new_int64(generation));
+		afb_req_reply(req, 0, 2, data);
+	}
+}
+
+/*
+ * Replies to a conditional query the shared 'text' of afm-udb
+ * whose reference is transferred. The reply uses the shared buffer
+ * without copying it.
+ */
+static void reply_conditional(afb_req_t req, const struct params *params, struct afm_udb_text *text, unsigned generation)
+{
+	afb_data_t data;
+
+	if (text2data(&data, text) < 0)
+		out_of_memory(req);
+	else
+		reply_conditional_data(req, params, data, generation);
+}
+
+/*
+ * On query "runnables" with the field list "fields" and/or the
+ * filter "filter", an object whose fields give the values that
+ * the fields of the listed applications must have.
+ */
+static void a_runnables_projected(afb_req_t req, const struct params *params,
+			struct json_object *fields, struct json_object *filter)
+{
+	struct json_object *item;
+	struct json_object_iter i;
+	struct afm_udb_text *resp;
+	const char **names, *(*filters)[2];
+	unsigned idx, nnames, nfilters, generation;
+	int all = (params->found & Param_All) != 0;
+
+	/* get the names of the fields */
+	names = NULL;
+	filters = NULL;
+	nnames = nfilters = 0;
+	if (fields != NULL) {
+		if (!json_object_is_type(fields, json_type_array))
+			goto bad_request;
+		nnames = (unsigned)json_object_array_length(fields);
+		names = malloc((nnames + !nnames) * sizeof *names);
+		if (names == NULL)
+			goto out_of_memory;
+		for (idx = 0 ; idx < nnames ; idx++) {
+			item = json_object_array_get_idx(fields, idx);
+			if (!json_object_is_type(item, json_type_string))
+				goto bad_request;
+			names[idx] = json_object_get_string(item);
+		}
+	}
+
+	/* get the filters */
+	if (filter != NULL) {
+		if (!json_object_is_type(filter, json_type_object))
+			goto bad_request;
+		filters = malloc((unsigned)(json_object_object_length(filter) + 1) * sizeof *filters);
+		if (filters == NULL)
+			goto out_of_memory;
+		json_object_object_foreachC(filter, i) {
+			if (!json_object_is_type(i.val, json_type_string)
+			 && !json_object_is_type(i.val, json_type_int)
+			 && !json_object_is_type(i.val, json_type_boolean))
+				goto bad_request;
+			filters[nfilters][0] = i.key;
+			filters[nfilters++][1] = json_object_get_string(i.val);
+		}
+	}
+
+	/* get the applications */
+	resp = afm_udb_applications_projected_text(afudb, all, params->uid,
+				names, nnames, (const char * const (*)[2])filters, nfilters, &generation);
+	if (resp)
+		reply_conditional(req, params, resp, generation);
+	else
+		out_of_memory(req);
+	free(names);
+	free(filters);
+	return;
+
+bad_request:
+	bad_request(req);
+	free(names);
+	free(filters);
+	return;
+
+out_of_memory:
+	out_of_memory(req);
+	free(names);
+	free(filters);
+}
+
 /*
  * On query "runnables"
  */
 static void a_runnables(afb_req_t req, const struct params *params)
 {
-	struct json_object *resp;
+	struct json_object *fields, *filter;
+	struct afm_udb_text *resp;
+	unsigned generation;
 	int all = (params->found & Param_All) != 0;
 
+	/* projected or filtered? */
+	fields = filter = NULL;
+	if (json_object_is_type(params->args, json_type_object)
+	 && (json_object_object_get_ex(params->args, _fields_, &fields)
+	  | json_object_object_get_ex(params->args, _filter_, &filter))) {
+		a_runnables_projected(req, params, fields, filter);
+		return;
+	}
+
 	/* get the applications */
-	resp = afm_udb_applications_public(afudb, all, params->uid);
-	reply_json_object(req, resp);
+	resp = afm_udb_applications_public_text(afudb, all, params->uid, &generation);
+	if (resp)
+		reply_conditional(req, params, resp, generation);
+	else
+		out_of_memory(req);
 }
 
 static void v_runnables(afb_req_t req, unsigned nargs, afb_data_t const *args)
 {
-	with_params(req, 0, Param_All, a_runnables);
+	with_params(req, 0, Param_All | Param_Generation, a_runnables);
 }
 
 /*
@@ -511,28 +841,121 @@ static void v_runnables(afb_req_t req, unsigned nargs, afb_data_t const *args)
  */
 static void a_detail(afb_req_t req, const struct params *params)
 {
-	struct json_object *resp;
+	struct afm_udb_text *resp;
+	unsigned generation;
 
 	/* get the details */
-	resp = afm_udb_get_application_public(afudb, params->id, params->uid);
+	resp = afm_udb_get_application_public_text(afudb, params->id, params->uid, &generation);
 	if (resp)
-		reply_json_object(req, resp);
+		reply_conditional(req, params, resp, generation);
 	else
 		not_found(req);
 }
 
+/*
+ * On query "detail" for an array of ids. The reply is the array of
+ * the details or, for unknown ids, of an error item.
+ * It is made of the cached serializations of the details.
+ */
+static void a_details(afb_req_t req, const struct params *params)
+{
+	struct json_object *item;
+	struct afm_udb_text **texts;
+	afb_data_t data;
+	const char *id, *str;
+	unsigned idx, count, generation, gen;
+	size_t length, off, len;
+	char *buffer;
+
+	/* check the ids */
+	count = (unsigned)json_object_array_length(params->ids);
+	for (idx = 0 ; idx < count ; idx++) {
+		if (!json_object_is_type(json_object_array_get_idx(params->ids, idx), json_type_string)) {
+			bad_request(req);
+			return;
+		}
+	}
+
+	/* get the serialized details */
+	texts = calloc(count + !count, sizeof *texts);
+	if (texts == NULL) {
+		out_of_memory(req);
+		return;
+	}
+	/* the generation replied is the oldest one, the one of the first search,
+	 * so that the next conditional query replies again after changes */
+	generation = count ? 0 : afm_udb_generation(afudb);
+	length = 3 + count;
+	for (idx = 0 ; idx < count ; idx++) {
+		id = json_object_get_string(json_object_array_get_idx(params->ids, idx));
+		texts[idx] = afm_udb_get_application_public_text(afudb, id, params->uid,
+							idx ? &gen : &generation);
+		if (texts[idx] == NULL) {
+			item = NULL;
+			rp_jsonc_pack(&item, "{ss ss}", _id_, id, _error_, _not_found_);
+			if (item != NULL) {
+				str = json_object_to_json_string_length(item, JSON_C_TO_STRING_PLAIN, &len);
+				if (str != NULL)
+					texts[idx] = afm_udb_text_create(str, len);
+			}
+			json_object_put(item);
+		}
+		if (texts[idx] != NULL)
+			length += afm_udb_text_length(texts[idx]);
+	}
+
+	/* join them in an array */
+	buffer = malloc(length);
+	if (buffer != NULL) {
+		off = 0;
+		buffer[off++] = '[';
+		for (idx = 0 ; idx < count ; idx++) {
+			if (texts[idx] != NULL) {
+				if (off > 1)
+					buffer[off++] = ',';
+				len = afm_udb_text_length(texts[idx]);
+				memcpy(&buffer[off], afm_udb_text_string(texts[idx]), len);
+				off += len;
+			}
+		}
+		buffer[off++] = ']';
+		buffer[off++] = 0;
+	}
+	for (idx = 0 ; idx < count ; idx++)
+		afm_udb_text_unref(texts[idx]);
+	free(texts);
+
+	if (buffer == NULL || afb_create_data_raw(&data, AFB_PREDEFINED_TYPE_JSON, buffer, off, free, buffer) < 0)
+		out_of_memory(req);
+	else
+		reply_conditional_data(req, params, data, generation);
+}
+
 static void v_detail(afb_req_t req, unsigned nargs, afb_data_t const *args)
 {
-	with_params(req, Param_Id, 0, a_detail);
+	if (is_batch(req))
+		with_params(req, Param_Ids, Param_Generation, a_details);
+	else
+		with_params(req, Param_Id, Param_Generation, a_detail);
 }
 
 /*
- * On query "start"
+ * Records a pending start for the reply
  */
-static void a_start(afb_req_t req, const struct params *params)
+struct pending_start {
+	afb_req_t req;
+	int uid;
+};
+
+/*
+ * Launches asynchronously the application of 'params' and
+ * calls 'callback' with the runid when done
+ */
+static void start_async(afb_req_t req, const struct params *params, void (*callback)(void *closure, int runid))
 {
-	struct json_object *appli, *resp;
-	int runid;
+	struct json_object *appli;
+	struct pending_start *ps;
+	int rc;
 
 	/* get the application */
 	appli = afm_udb_get_application_private(afudb, params->id, params->uid);
@@ -541,55 +964,188 @@ static void a_start(afb_req_t req, const struct params *params)
 		return;
 	}
 
-	/* launch the application */
-	runid = afm_urun_start(appli, params->uid);
-	if (runid < 0) {
+	/* record the request */
+	ps = malloc(sizeof *ps);
+	if (ps == NULL) {
+		json_object_put(appli);
 		cant_start(req);
 		return;
 	}
+	ps->req = afb_req_addref(req);
+	ps->uid = params->uid;
+
+	/* launch the application */
+	rc = afm_urun_once_async(appli, params->uid, callback, ps);
+	json_object_put(appli);
+	if (rc < 0) {
+		cant_start(req);
+		afb_req_unref(req);
+		free(ps);
+	}
+}
+
+static void started(void *closure, int runid)
+{
+	struct pending_start *ps = closure;
+	struct json_object *resp;
+
+	if (runid < 0)
+		cant_start(ps->req);
+	else {
+		resp = NULL;
+		if (runid)
+			rp_jsonc_pack(&resp, "i", runid);
+		reply_json_object(ps->req, resp);
+	}
+	afb_req_unref(ps->req);
+	free(ps);
+}
 
-	/* returns */
-	resp = NULL;
-	if (runid)
-		rp_jsonc_pack(&resp, "i", runid);
-	reply_json_object(req, resp);
+/*
+ * On query "start"
+ */
+static void a_start(afb_req_t req, const struct params *params)
+{
+	start_async(req, params, started);
 }
 
 static void v_start(afb_req_t req, unsigned nargs, afb_data_t const *args)
 {
-	with_params(req, Param_Id, 0, a_start);
+	with_params_in_loop(req, Param_Id, 0, a_start);
 }
 
 /*
  * On query "once"
  */
+static void started_once(void *closure, int runid)
+{
+	struct pending_start *ps = closure;
+	struct json_object *resp;
+
+	if (runid < 0)
+		cant_start(ps->req);
+	else {
+		/* returns the state */
+		resp = runid ? afm_urun_state(afudb, runid, ps->uid) : NULL;
+		reply_json_object(ps->req, resp);
+	}
+	afb_req_unref(ps->req);
+	free(ps);
+}
+
 static void a_once(afb_req_t req, const struct params *params)
 {
-	struct json_object *appli, *resp;
-	int runid;
+	start_async(req, params, started_once);
+}
 
-	/* get the application */
-	appli = afm_udb_get_application_private(afudb, params->id, params->uid);
-	if (appli == NULL) {
-		not_found(req);
-		return;
+static void v_once(afb_req_t req, unsigned nargs, afb_data_t const *args)
+{
+	with_params_in_loop(req, Param_Id, 0, a_once);
+}
+
+/*
+ * Records a pending start of many applications
+ */
+struct pending_start_many {
+	afb_req_t req;
+	unsigned count;
+	struct json_object *ids;
+	struct json_object *applis[];
+};
+
+static void started_many(void *closure, const int runids[])
+{
+	struct pending_start_many *psm = closure;
+	struct json_object *resp, *item;
+	const char *id;
+	unsigned idx;
+
+	/* build the array of results */
+	resp = json_object_new_array();
+	for (idx = 0 ; resp && idx < psm->count ; idx++) {
+		item = NULL;
+		id = json_object_get_string(json_object_array_get_idx(psm->ids, idx));
+		if (psm->applis[idx] == NULL)
+			rp_jsonc_pack(&item, "{ss ss}", _id_, id, _error_, _not_found_);
+		else if (runids[idx] < 0)
+			rp_jsonc_pack(&item, "{ss ss}", _id_, id, _error_, _cannot_start_);
+		else if (runids[idx] == 0)
+			rp_jsonc_pack(&item, "{ss}", _id_, id);
+		else
+			rp_jsonc_pack(&item, "{ss si}", _id_, id, _runid_, runids[idx]);
+		json_object_array_add(resp, item);
+	}
+	if (resp)
+		reply_json_object(psm->req, resp);
+	else {
+		/* forward the first error of the results if any */
+		for (idx = 0 ; idx < psm->count
+				&& psm->applis[idx] != NULL && runids[idx] >= 0 ; idx++);
+		if (idx == psm->count)
+			out_of_memory(psm->req);
+		else if (psm->applis[idx] == NULL)
+			not_found(psm->req);
+		else
+			cant_start(psm->req);
 	}
 
-	/* launch the application */
-	runid = afm_urun_once(appli, params->uid);
-	if (runid < 0) {
-		cant_start(req);
-		return;
+	/* release */
+	for (idx = 0 ; idx < psm->count ; idx++)
+		json_object_put(psm->applis[idx]);
+	json_object_put(psm->ids);
+	afb_req_unref(psm->req);
+	free(psm);
+}
+
+/*
+ * On query "start-many"
+ */
+static void a_start_many(afb_req_t req, const struct params *params)
+{
+	struct pending_start_many *psm;
+	struct json_object *id;
+	unsigned idx, count;
+	int rc;
+
+	/* check the ids */
+	count = (unsigned)json_object_array_length(params->ids);
+	for (idx = 0 ; idx < count ; idx++) {
+		id = json_object_array_get_idx(params->ids, idx);
+		if (!json_object_is_type(id, json_type_string)) {
+			bad_request(req);
+			return;
+		}
 	}
 
-	/* returns the state */
-	resp = runid ? afm_urun_state(afudb, runid, params->uid) : NULL;
-	reply_json_object(req, resp);
+	/* get the applications */
+	psm = malloc(sizeof *psm + count * sizeof *psm->applis);
+	if (psm == NULL) {
+		out_of_memory(req);
+		return;
+	}
+	for (idx = 0 ; idx < count ; idx++)
+		psm->applis[idx] = afm_udb_get_application_private(afudb,
+			json_object_get_string(json_object_array_get_idx(params->ids, idx)),
+			params->uid);
+	psm->req = afb_req_addref(req);
+	psm->count = count;
+	psm->ids = json_object_get(params->ids);
+
+	/* launch the applications */
+	rc = afm_urun_start_many(count, psm->applis, params->uid, started_many, psm);
+	if (rc < 0) {
+		reply_errno(req);
+		for (idx = 0 ; idx < count ; idx++)
+			json_object_put(psm->applis[idx]);
+		json_object_put(psm->ids);
+		free(psm);
+		afb_req_unref(req);
+	}
 }
 
-static void v_once(afb_req_t req, unsigned nargs, afb_data_t const *args)
+static void v_start_many(afb_req_t req, unsigned nargs, afb_data_t const *args)
 {
-	with_params(req, Param_Id, 0, a_once);
+	with_params_in_loop(req, Param_Ids, 0, a_start_many);
 }
 
 /*
@@ -597,13 +1153,13 @@ static void v_once(afb_req_t req, unsigned nargs, afb_data_t const *args)
  */
 static void a_pause(afb_req_t req, const struct params *params)
 {
-	int status = afm_urun_pause(params->runid, params->uid);
+	int status = afm_urun_pause(afudb, params->runid, params->uid);
 	reply_status(req, status);
 }
 
 static void v_pause(afb_req_t req, unsigned nargs, afb_data_t const *args)
 {
-	with_params(req, Param_RunId, 0, a_pause);
+	with_params_in_loop(req, Param_RunId, 0, a_pause);
 }
 
 /*
@@ -611,13 +1167,13 @@ static void v_pause(afb_req_t req, unsigned nargs, afb_data_t const *args)
  */
 static void a_resume(afb_req_t req, const struct params *params)
 {
-	int status = afm_urun_resume(params->runid, params->uid);
+	int status = afm_urun_resume(afudb, params->runid, params->uid);
 	reply_status(req, status);
 }
 
 static void v_resume(afb_req_t req, unsigned nargs, afb_data_t const *args)
 {
-	with_params(req, Param_RunId, 0, a_resume);
+	with_params_in_loop(req, Param_RunId, 0, a_resume);
 }
 
 /*
@@ -631,7 +1187,18 @@ static void a_terminate(afb_req_t req, const struct params *params)
 
 static void v_terminate(afb_req_t req, unsigned nargs, afb_data_t const *args)
 {
-	with_params(req, Param_RunId, 0, a_terminate);
+	with_params_in_loop(req, Param_RunId, 0, a_terminate);
+}
+
+/*
+ * Replies the listed runners to the pending request
+ */
+static void listed(void *closure, struct json_object *list)
+{
+	afb_req_t req = closure;
+
+	reply_json_object(req, list);
+	afb_req_unref(req);
 }
 
 /*
@@ -640,13 +1207,17 @@ static void v_terminate(afb_req_t req, unsigned nargs, afb_data_t const *args)
 static void a_runners(afb_req_t req, const struct params *params)
 {
 	int all = (params->found & Param_All) != 0;
-	struct json_object *resp = afm_urun_list(afudb, all, params->uid);
-	reply_json_object(req, resp);
+
+	afb_req_addref(req);
+	if (afm_urun_list_async(afudb, all, params->uid, listed, req) < 0) {
+		out_of_memory(req);
+		afb_req_unref(req);
+	}
 }
 
 static void v_runners(afb_req_t req, unsigned nargs, afb_data_t const *args)
 {
-	with_params(req, 0, Param_All, a_runners);
+	with_params_in_loop(req, 0, Param_All, a_runners);
 }
 
 /*
@@ -661,29 +1232,201 @@ static void a_state(afb_req_t req, const struct params *params)
 		reply_error(req, NULL, AFB_ERRNO_INTERNAL_ERROR);
 }
 
+/*
+ * On query "state" for an array of runids or ids. The reply is the
+ * array of the states or, for items not running, of an error item.
+ */
+static void a_states(afb_req_t req, const struct params *params)
+{
+	struct json_object *resp, *item, *elem;
+	const char *id;
+	unsigned idx, count;
+	int runid;
+
+	/* check the items */
+	count = (unsigned)json_object_array_length(params->ids);
+	for (idx = 0 ; idx < count ; idx++) {
+		elem = json_object_array_get_idx(params->ids, idx);
+		if (!json_object_is_type(elem, json_type_int)
+		 && !json_object_is_type(elem, json_type_string)) {
+			bad_request(req);
+			return;
+		}
+	}
+
+	/* build the array of states */
+	resp = json_object_new_array();
+	for (idx = 0 ; resp && idx < count ; idx++) {
+		item = NULL;
+		elem = json_object_array_get_idx(params->ids, idx);
+		if (json_object_is_type(elem, json_type_int)) {
+			runid = json_object_get_int(elem);
+			item = afm_urun_state(afudb, runid, params->uid);
+			if (item == NULL)
+				rp_jsonc_pack(&item, "{si ss}", _runid_, runid, _error_, _not_running_);
+		}
+		else {
+			id = json_object_get_string(elem);
+			runid = afm_urun_search_runid(afudb, id, params->uid);
+			if (runid < 0)
+				rp_jsonc_pack(&item, "{ss ss}", _id_, id, _error_,
+						errno == ESRCH ? _not_running_ : _not_found_);
+			else {
+				item = afm_urun_state(afudb, runid, params->uid);
+				if (item == NULL)
+					rp_jsonc_pack(&item, "{ss ss}", _id_, id, _error_, _not_running_);
+			}
+		}
+		json_object_array_add(resp, item);
+	}
+	if (resp)
+		reply_json_object(req, resp);
+	else
+		out_of_memory(req);
+}
+
 static void v_state(afb_req_t req, unsigned nargs, afb_data_t const *args)
 {
-	with_params(req, Param_RunId, 0, a_state);
+	if (is_batch(req))
+		with_params_in_loop(req, Param_Ids, 0, a_states);
+	else
+		with_params_in_loop(req, Param_RunId, 0, a_state);
+}
+
+/*
+ * On query "stats"
+ */
+static void a_stats(afb_req_t req, const struct params *params)
+{
+	struct json_object *resp = afm_urun_stats(params->found & Param_Id ? params->id : NULL);
+	if (resp != NULL)
+		reply_json_object(req, resp);
+	else
+		out_of_memory(req);
 }
 
+static void v_stats(afb_req_t req, unsigned nargs, afb_data_t const *args)
+{
+	with_params_in_loop(req, 0, Param_Id, a_stats);
+}
+
+/*
+ * Refreshes the application database.
+ * When the directories of units are watched, only changed units are
+ * read again. Otherwise, or when 'forced', the full database is rebuilt.
+ */
+static void refresh(int forced)
+{
+	struct json_object *changes;
+	int rc;
+
+	rc = forced ? -1 : afm_udb_watch_process(afudb, &changes);
+	if (rc < 0)
+		rc = afm_udb_update(afudb, &changes);
+	if (rc > 0 || forced) {
+		/* installed or removed applications may change permissions */
+		auth_flush();
+		application_list_changed(_update_, _update_, changes);
+	}
+	json_object_put(changes);
+}
+
+/*
+ * Performs in the event loop the queued actions
+ */
+static void on_loop(afb_evfd_t efd, int fd, uint32_t revents, void *closure)
+{
+	uint64_t count;
+	struct params *params;
+	afb_req_t req;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		RP_ERROR("can't read the event loop wake up: %m");
+
+	if (loop_sighup) {
+		loop_sighup = 0;
+		refresh(1);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&loop_mutex);
+		params = loop_head;
+		if (params != NULL) {
+			loop_head = params->next;
+			if (loop_head == NULL)
+				loop_tail = &loop_head;
+		}
+		pthread_mutex_unlock(&loop_mutex);
+		if (params == NULL)
+			break;
+		req = params->req;
+		check_runid(params);
+		afb_req_unref(req);
+	}
+}
+
+/*
+ * The refresh is done in the event loop
+ */
 static void onsighup(int signal)
 {
-	afm_udb_update(afudb);
-	application_list_changed(_update_, _update_);
+	uint64_t one = 1;
+
+	loop_sighup = 1;
+	if (write(loop_fd, &one, sizeof one) < 0)
+		return; /* nothing more can be done in a signal handler */
+}
+
+static void on_units_changed(afb_evfd_t efd, int fd, uint32_t revents, void *closure)
+{
+	refresh(0);
 }
 
 static int init(afb_api_t api)
 {
+	int fd;
+	afb_evfd_t efd;
+	struct sd_bus *bus;
+
+	/* init the queue of the event loop */
+	loop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (loop_fd < 0 || afb_evfd_create(&efd, loop_fd, EPOLLIN, on_loop, NULL, 0, 1) < 0) {
+		RP_ERROR("can't create the queue of the event loop");
+		return -1;
+	}
+
 	/* init database */
-	afudb = afm_udb_create(1, 0, "afm-");
+	afudb = afm_udb_create(1, 0, "afm-", AFM_UDB_SNAPSHOT);
 	if (!afudb) {
 		RP_ERROR("afm_udb_create failed");
 		return -1;
 	}
 
+	/* use the buses of the binder for waiting units asynchronously */
+	bus = afb_systemd_get_system_bus();
+	if (bus)
+		systemd_set_bus(0, bus);
+	bus = afb_systemd_get_user_bus();
+	if (bus)
+		systemd_set_bus(1, bus);
+
+	/* watch changes of units */
+	fd = afm_udb_watch(afudb);
+	if (fd < 0 || afb_evfd_create(&efd, fd, EPOLLIN, on_units_changed, NULL, 0, 0) < 0)
+		RP_WARNING("can't watch units, refresh on SIGHUP only");
+
 	signal(SIGHUP, onsighup);
 
-	/* create the event */
+	/* create the events */
+	if (afb_api_new_event(api, _appstarted_, &app_started_event) < 0
+	 || afb_api_new_event(api, _appstopped_, &app_stopped_event) < 0
+	 || afb_api_new_event(api, _appfailed_, &app_failed_event) < 0)
+		return -1;
+
+	/* listen the lifecycle of applications */
+	if (afm_urun_listen(afudb, application_lifecycle, NULL) < 0)
+		RP_WARNING("can't listen units, no lifecycle events");
+
 	return afb_api_new_event(api, _applstchg_, &applist_changed_event);
 }
 
@@ -697,12 +1440,14 @@ static const afb_verb_t verbs[] =
 	{.verb=_runnables_, .callback=v_runnables, .auth=&auth_detail,    .info="Get list of runnable applications",          .session=AFB_SESSION_CHECK },
 	{.verb=_detail_   , .callback=v_detail,    .auth=&auth_detail,    .info="Get the details for one application",        .session=AFB_SESSION_CHECK },
 	{.verb=_start_    , .callback=v_start,     .auth=&auth_start,     .info="Start an application",                       .session=AFB_SESSION_CHECK },
+	{.verb=_start_many_, .callback=v_start_many, .auth=&auth_start,  .info="Start many applications together",           .session=AFB_SESSION_CHECK },
 	{.verb=_once_     , .callback=v_once,      .auth=&auth_start,     .info="Start once an application",                  .session=AFB_SESSION_CHECK },
 	{.verb=_terminate_, .callback=v_terminate, .auth=&auth_kill,      .info="Terminate a running application",            .session=AFB_SESSION_CHECK },
 	{.verb=_pause_    , .callback=v_pause,     .auth=&auth_kill,      .info="Pause a running application",                .session=AFB_SESSION_CHECK },
 	{.verb=_resume_   , .callback=v_resume,    .auth=&auth_kill,      .info="Resume a paused application",                .session=AFB_SESSION_CHECK },
 	{.verb=_runners_  , .callback=v_runners,   .auth=&auth_state,     .info="Get the list of running applications",       .session=AFB_SESSION_CHECK },
 	{.verb=_state_    , .callback=v_state,     .auth=&auth_state,     .info="Get the state of a running application",     .session=AFB_SESSION_CHECK },
+	{.verb=_stats_    , .callback=v_stats,     .auth=&auth_state,     .info="Get the statistics of starts of applications", .session=AFB_SESSION_CHECK },
 	{.verb=NULL }
 };
 
@@ -712,6 +1457,6 @@ const afb_binding_t afbBindingExport = {
 	.info = "Application Framework Master Service",
 	.verbs = verbs,
 	.mainctl = mainctl,
-	.noconcurrency = 1 /* relies on binder for serialization of requests */
+	.noconcurrency = 0 /* actions using systemd are serialized in the event loop */
 };
 
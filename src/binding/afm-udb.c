@@ -26,18 +26,27 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
 
 #include <json-c/json.h>
 
 #include "utils-json.h"
 #include "utils-systemd.h"
 #include "unit-fs.h"
-#include <rp-utils/rp-file.h>
+#include "unit-scan.h"
 
 #include "afm-udb.h"
 
@@ -51,63 +60,324 @@ static const char scope_system[] = "system";
 static const char key_id[] = "id";
 static const char key_visibility[] = "visibility";
 static const char value_visible[] = "visible";
+static const char key_added[] = "added";
+static const char key_removed[] = "removed";
+static const char key_modified[] = "modified";
+
+/* maximum count of threads reading units */
+#if !defined(AFM_UDB_THREADS)
+#define AFM_UDB_THREADS 4
+#endif
+
+/* minimum count of units for starting one more reading thread */
+#if !defined(AFM_UDB_UNITS_PER_THREAD)
+#define AFM_UDB_UNITS_PER_THREAD 32
+#endif
 
-#define x_afm_prefix_length  (sizeof x_afm_prefix - 1)
 #define service_extension_length  (sizeof service_extension - 1)
 
+/*
+ * The structure app_field records one X-AFM- field of an application
+ */
+struct app_field {
+	const char *name;		/* interned name of the field (without '-') */
+	const char *value;		/* value of the field */
+	unsigned flags;			/* FIELD_PRIVATE, FIELD_INTEGER */
+};
+
+#define FIELD_PRIVATE  1		/* the field is private */
+#define FIELD_INTEGER  2		/* the value is an integer */
+
+/*
+ * The structure app_record records the data of one application in
+ * one allocation: the table of its fields is followed by the strings.
+ * JSON views of the application are only created on need.
+ */
+struct app_record {
+	unsigned refcount;		/* count of references to the record */
+	unsigned count;			/* count of fields */
+	int isuser;			/* is a user unit? */
+	int visible;			/* is the application visible? */
+	const char *id;			/* id of the application */
+	const char *path;		/* path of the unit */
+	const char *name;		/* name of the unit */
+	struct json_object *priv;	/* private view or NULL */
+	struct afm_udb_text *text;	/* serialization of the public view or NULL */
+	struct app_field fields[];	/* the fields */
+};
+
+/*
+ * The structure app_index is an entry of the indexes of applications
+ */
+struct app_index {
+	struct app_record *record;	/* the indexed record */
+	unsigned order;			/* the order of the record in the scan */
+};
+
 /*
  * The structure afm_apps records the data about applications
  * for several accesses.
  */
 struct afm_apps {
+	unsigned count;			/* count of applications */
+	unsigned size;			/* allocated count of applications */
+	struct app_record **all;	/* the applications in scan order */
+	struct app_index *byname;	/* the applications sorted by id */
+	unsigned hmask;			/* mask of the size of the hashes */
+	struct app_record **hbyname;	/* hash of the applications by id */
+	struct app_record **hbynocase;	/* hash of the applications by lower case id */
 	struct {
-		struct json_object *visibles; /* array of the private data of visible apps */
-		struct json_object *all; /* array of the private data of all apps */
-		struct json_object *byname; /* hash of application's privates */
-	} privates, publics;
+		struct afm_udb_text *visibles; /* serialization of visible publics or NULL */
+		struct afm_udb_text *all; /* serialization of all publics or NULL */
+	} texts;
+};
+
+/*
+ * The structure afm_udb_text is an immutable serialization shared
+ * by the replies until its count of references falls to zero.
+ * The count is atomic because replies are released by any thread.
+ */
+struct afm_udb_text {
+	unsigned refcount;		/* count of references to the text */
+	size_t length;			/* length of the string */
+	char string[];			/* the zero terminated string */
+};
+
+/*
+ * The structure intern records the names of the fields once for all
+ */
+struct intern {
+	const char **table;		/* hash table of the names */
+	unsigned count;			/* count of names */
+	unsigned size;			/* size of the table (a power of 2) */
+	struct chunk *chunks;		/* the memory of the names */
+};
+
+/*
+ * The structure chunk holds the memory of interned strings
+ */
+struct chunk {
+	struct chunk *next;		/* next chunk */
+	size_t used;			/* used size of data */
+	size_t size;			/* allocated size of data */
+	char data[];			/* the data */
 };
 
+#define CHUNK_SIZE  1024
+
 /*
  * The structure afm_udb records the applications
- * for a set of directories recorded as a linked list
+ * for a set of directories recorded as a linked list.
+ * Updates are made by one thread that builds the new applications
+ * apart and swaps them under 'lock'. Readers of other threads hold
+ * 'lock' while reading the current applications and their caches.
  */
 struct afm_udb {
 	struct afm_apps applications;	/* the data about applications */
+	pthread_mutex_t lock;		/* lock of applications and caches */
 	int refcount;			/* count of references to the structure */
 	int system;			/* is managing system units? */
 	int user;			/* is managing user units? */
+	int watchfd;			/* inotify's file descriptor or -1 */
+	int watchsys;			/* watch descriptor of system units */
+	int watchusr;			/* watch descriptor of user units */
+	unsigned generation;		/* generation of the applications */
+	struct intern names;		/* names of the fields */
+	char *snapshot;			/* path of the snapshot or NULL */
 	size_t prefixlen;		/* length of the prefix */
 	char prefix[1];			/* filtering prefix */
 };
 
+/*
+ * The structure fields records the X-AFM- fields of a unit
+ */
+struct fields {
+	unsigned count;			/* count of fields */
+	unsigned size;			/* allocated count of fields */
+	const char *(*pairs)[2];	/* name and value of the fields */
+};
+
+/*
+ * The structure snapbuf is used for building snapshots
+ */
+struct snapbuf {
+	char *data;			/* the data */
+	size_t length;			/* length of the data */
+	size_t size;			/* allocated size of data */
+	unsigned count;			/* count of units */
+	int error;			/* error status */
+};
+
 /*
  * The structure afm_updt is internally used for updates
  */
 struct afm_updt {
 	struct afm_udb *afudb;
 	struct afm_apps applications;
+	struct fields fields;
+	struct snapbuf *snap;
+};
+
+/*
+ * The structure unit_job records the reading of one unit
+ */
+struct unit_job {
+	char *path;			/* path of the unit */
+	const char *name;		/* name of the unit (in path) */
+	int isuser;			/* is a user unit? */
+	int error;			/* error while reading or 0 */
+	char *content;			/* names and values of the fields */
+	struct fields fields;		/* fields of the unit (in content) */
+	struct stat st;			/* status of the unit before reading */
+};
+
+/*
+ * The structure unit_jobs records the units to be read
+ */
+struct unit_jobs {
+	struct afm_udb *afudb;		/* the database */
+	struct unit_job *jobs;		/* the jobs */
+	unsigned count;			/* count of jobs */
+	unsigned size;			/* allocated count of jobs */
+	unsigned next;			/* next job to be processed */
+	int withstat;			/* should get status of the units? */
+};
+
+/*
+ * Snapshots are files recording the X-AFM- fields of the scanned units
+ * together with the status of the units and of their directories. When
+ * the recorded status are still matching the files, the snapshot is
+ * used instead of reading and parsing the units.
+ *
+ * Layout: the header 'snap_head' followed by the strings of the prefix,
+ * of the system directory and of the user directory, then for each unit
+ * a record 'snap_unit' followed by the path and the pairs of strings
+ * name and value of its fields. Header and records are aligned on 8 bytes.
+ */
+#define SNAP_MAGIC   0x41465531 /* "AFU1" */
+#define SNAP_ALIGN   8
+#define SNAP_SYSTEM  1
+#define SNAP_USER    2
+
+struct snap_stat {
+	uint64_t ino;			/* inode of the file */
+	uint64_t size;			/* size of the file */
+	int64_t sec;			/* modification time (seconds) */
+	int64_t nsec;			/* modification time (nanoseconds) */
+};
+
+struct snap_head {
+	uint32_t magic;			/* SNAP_MAGIC */
+	uint32_t flags;			/* scanned scopes: SNAP_SYSTEM, SNAP_USER */
+	uint32_t count;			/* count of units */
+	uint32_t length;		/* length of the strings after the header */
+	int64_t stamp;			/* time of the scan */
+	struct snap_stat dirs[2];	/* status of system and user directories */
+};
+
+struct snap_unit {
+	uint32_t size;			/* size of the record */
+	uint32_t isuser;		/* is the unit a user unit? */
+	uint32_t npairs;		/* count of fields */
+	uint32_t pad;			/* unused */
+	struct snap_stat stat;		/* status of the unit file */
 };
 
+/*
+ * Get in 'names' the interned version of 'name'.
+ * Returns the interned string or NULL on memory depletion.
+ */
+static const char *intern(struct intern *names, const char *name)
+{
+	const char **table, *str;
+	struct chunk *chunk;
+	unsigned idx, hash, size, i, h;
+	size_t length;
+
+	/* search the name */
+	for (hash = 5381, idx = 0 ; name[idx] ; idx++)
+		hash = hash * 33 + (unsigned char)name[idx];
+	length = idx + 1;
+	if (names->size) {
+		for (idx = hash & (names->size - 1) ; names->table[idx] ; idx = (idx + 1) & (names->size - 1))
+			if (!strcmp(names->table[idx], name))
+				return names->table[idx];
+	}
+
+	/* grow the table when half full */
+	if (2 * (names->count + 1) > names->size) {
+		size = names->size ? 2 * names->size : 64;
+		table = calloc(size, sizeof *table);
+		if (table == NULL)
+			return NULL;
+		for (i = 0 ; i < names->size ; i++) {
+			str = names->table[i];
+			if (str) {
+				for (h = 5381 ; *str ; str++)
+					h = h * 33 + (unsigned char)*str;
+				for (idx = h & (size - 1) ; table[idx] ; idx = (idx + 1) & (size - 1));
+				table[idx] = names->table[i];
+			}
+		}
+		free(names->table);
+		names->table = table;
+		names->size = size;
+		for (idx = hash & (size - 1) ; table[idx] ; idx = (idx + 1) & (size - 1));
+	}
+
+	/* store the name */
+	chunk = names->chunks;
+	if (chunk == NULL || chunk->size - chunk->used < length) {
+		size = (unsigned)(length > CHUNK_SIZE ? length : CHUNK_SIZE);
+		chunk = malloc(size + sizeof *chunk);
+		if (chunk == NULL)
+			return NULL;
+		chunk->used = 0;
+		chunk->size = size;
+		chunk->next = names->chunks;
+		names->chunks = chunk;
+	}
+	str = memcpy(&chunk->data[chunk->used], name, length);
+	chunk->used += length;
+	names->table[idx] = str;
+	names->count++;
+	return str;
+}
+
+/*
+ * Release the memory used by 'names'
+ */
+static void intern_put(struct intern *names)
+{
+	struct chunk *chunk;
+
+	while ((chunk = names->chunks) != NULL) {
+		names->chunks = chunk->next;
+		free(chunk);
+	}
+	free(names->table);
+}
+
+/*
+ * Removes a reference to the application record 'rec'
+ */
+static void record_unref(struct app_record *rec)
+{
+	if (!--rec->refcount) {
+		json_object_put(rec->priv);
+		afm_udb_text_unref(rec->text);
+		free(rec);
+	}
+}
+
 /*
  * initilize object 'apps'.
  * returns 1 if okay or 0 on case of memory depletion
  */
 static int apps_init(struct afm_apps *apps)
 {
-	apps->publics.all = json_object_new_array();
-	apps->publics.visibles = json_object_new_array();
-	apps->publics.byname = json_object_new_object();
-
-	apps->privates.all = json_object_new_array();
-	apps->privates.visibles = json_object_new_array();
-	apps->privates.byname = json_object_new_object();
-
-	return apps->publics.all
-	   && apps->publics.visibles
-	   && apps->publics.byname
-	   && apps->privates.all
-	   && apps->privates.visibles
-	   && apps->privates.byname;
+	memset(apps, 0, sizeof *apps);
+	return 1;
 }
 
 /*
@@ -115,12 +385,142 @@ static int apps_init(struct afm_apps *apps)
  */
 static void apps_put(struct afm_apps *apps)
 {
-	json_object_put(apps->publics.all);
-	json_object_put(apps->publics.visibles);
-	json_object_put(apps->publics.byname);
-	json_object_put(apps->privates.all);
-	json_object_put(apps->privates.visibles);
-	json_object_put(apps->privates.byname);
+	unsigned idx;
+
+	for (idx = 0 ; idx < apps->count ; idx++)
+		record_unref(apps->all[idx]);
+	free(apps->all);
+	free(apps->byname);
+	free(apps->hbyname);
+	afm_udb_text_unref(apps->texts.all);
+	afm_udb_text_unref(apps->texts.visibles);
+}
+
+/*
+ * Records in 'apps' the application 'rec'.
+ * The given reference of 'rec' is transferred to 'apps'.
+ * Returns 0 on success or -1 with errno = ENOMEM.
+ */
+static int apps_add(struct afm_apps *apps, struct app_record *rec)
+{
+	unsigned size;
+	struct app_record **all;
+
+	if (apps->count == apps->size) {
+		size = apps->size ? 2 * apps->size : 64;
+		all = realloc(apps->all, size * sizeof *all);
+		if (all == NULL) {
+			record_unref(rec);
+			errno = ENOMEM;
+			return -1;
+		}
+		apps->all = all;
+		apps->size = size;
+	}
+	apps->all[apps->count++] = rec;
+	return 0;
+}
+
+/*
+ * Compare entries of indexes by id, then by order
+ */
+static int cmp_byname(const void *a, const void *b)
+{
+	const struct app_index *x = a, *y = b;
+	int rc = strcmp(x->record->id, y->record->id);
+	return rc ? rc : (x->order > y->order) - (x->order < y->order);
+}
+
+/*
+ * Computes the hash of 'id', case insensitive if 'nocase' isn't zero
+ */
+static unsigned hash_id(const char *id, int nocase)
+{
+	unsigned char c;
+	unsigned h = 0;
+
+	while ((c = (unsigned char)*id++))
+		h = 31 * h + (unsigned)(nocase ? tolower(c) : c);
+	return h;
+}
+
+/*
+ * Creates the indexes of 'apps': the list sorted by id and the hashes
+ * of ids. In the hash by id, the last recorded application of an id
+ * wins. In the hash by lower case id, the first recorded one wins.
+ * Returns 0 on success or -1 with errno = ENOMEM.
+ */
+static int apps_index(struct afm_apps *apps)
+{
+	unsigned idx, h, size;
+	struct app_record *rec;
+
+	free(apps->byname);
+	free(apps->hbyname);
+	for (size = 16 ; size < 2 * apps->count ; size <<= 1);
+	apps->hmask = size - 1;
+	apps->byname = malloc((apps->count + 1) * sizeof *apps->byname);
+	apps->hbyname = calloc(2 * size, sizeof *apps->hbyname);
+	if (apps->byname == NULL || apps->hbyname == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	apps->hbynocase = &apps->hbyname[size];
+	for (idx = 0 ; idx < apps->count ; idx++) {
+		rec = apps->all[idx];
+		apps->byname[idx].record = rec;
+		apps->byname[idx].order = idx;
+		for (h = hash_id(rec->id, 0) & apps->hmask
+			; apps->hbyname[h] != NULL && strcmp(apps->hbyname[h]->id, rec->id)
+			; h = (h + 1) & apps->hmask);
+		apps->hbyname[h] = rec;
+		for (h = hash_id(rec->id, 1) & apps->hmask
+			; apps->hbynocase[h] != NULL && strcasecmp(apps->hbynocase[h]->id, rec->id)
+			; h = (h + 1) & apps->hmask);
+		if (apps->hbynocase[h] == NULL)
+			apps->hbynocase[h] = rec;
+	}
+	qsort(apps->byname, apps->count, sizeof *apps->byname, cmp_byname);
+	return 0;
+}
+
+/*
+ * Get in 'apps' the application of exactly 'id' or NULL if none.
+ */
+static struct app_record *apps_get(const struct afm_apps *apps, const char *id)
+{
+	unsigned h;
+	struct app_record *rec;
+
+	if (apps->hbyname == NULL)
+		return NULL;
+	for (h = hash_id(id, 0) & apps->hmask
+		; (rec = apps->hbyname[h]) != NULL && strcmp(rec->id, id)
+		; h = (h + 1) & apps->hmask);
+	return rec;
+}
+
+/*
+ * Search in 'apps' the application of 'id'. When many applications
+ * have the same id, the last recorded is returned. When not found,
+ * the search is case insensitive and the first recorded is returned.
+ * Returns the found application or NULL.
+ */
+static struct app_record *apps_search(const struct afm_apps *apps, const char *id)
+{
+	unsigned h;
+	struct app_record *rec;
+
+	/* search case sensitively */
+	rec = apps_get(apps, id);
+	if (rec != NULL || apps->hbynocase == NULL)
+		return rec;
+
+	/* fallback to a case insensitive search */
+	for (h = hash_id(id, 1) & apps->hmask
+		; (rec = apps->hbynocase[h]) != NULL && strcasecmp(rec->id, id)
+		; h = (h + 1) & apps->hmask);
+	return rec;
 }
 
 /*
@@ -159,300 +559,941 @@ static int append_field(
 }
 
 /*
- * Adds the field of 'name' and 'value' in 'priv' and also if possible in 'pub'
- * Returns 0 on success or -1 on error.
+ * Is 'value' an integer?
+ * Returns 1 if yes or 0 if not.
  */
-static int add_field(
-		struct json_object *priv,
-		struct json_object *pub,
-		const char *name,
-		const char *value
-)
+static int is_integer(const char *value)
 {
-	long int ival;
 	char *end;
-	struct json_object *v;
 
-	/* try to adapt the value to its type */
 	errno = 0;
-	ival = strtol(value, &end, 10);
-	if (*value && !*end && !errno) {
-		/* integer value */
-		v = json_object_new_int64(ival);
-	} else {
-		/* string value */
-		v = json_object_new_string(value);
-	}
+	strtoll(value, &end, 10);
+	return *value && !*end && !errno;
+}
+
+/*
+ * Adds to 'object' the field 'name' of 'value', as an integer
+ * when 'integer' isn't zero.
+ * Returns 0 on success or -1 on error.
+ */
+static int add_field(struct json_object *object, const char *name, const char *value, int integer)
+{
+	struct json_object *v;
+
+	v = integer ? json_object_new_int64(strtoll(value, NULL, 10))
+		    : json_object_new_string(value);
 	if (!v) {
 		errno = ENOMEM;
 		return -1;
 	}
+	return append_field(object, name, v);
+}
+
+/*
+ * Creates the JSON view of the application record 'rec'.
+ * The private view includes the private fields and the fields
+ * describing the unit.
+ * Returns the created object or NULL with errno = ENOMEM.
+ */
+static struct json_object *record_view(const struct app_record *rec, int priv)
+{
+	struct json_object *object;
+	const struct app_field *field;
+	unsigned idx;
 
-	/* add the value */
-	if (name[0] == '-') {
-		/* private value */
-		append_field(priv, &name[1], v);
-	} else {
-		/* public value */
-		append_field(priv, name, json_object_get(v));
-		append_field(pub, name, v);
+	object = json_object_new_object();
+	if (object == NULL)
+		goto error;
+	for (idx = 0 ; idx < rec->count ; idx++) {
+		field = &rec->fields[idx];
+		if ((priv || !(field->flags & FIELD_PRIVATE))
+		 && add_field(object, field->name, field->value, field->flags & FIELD_INTEGER) < 0)
+			goto error;
 	}
-	return 0;
+	if (priv
+	 && (add_field(object, &key_unit_path[1], rec->path, 0) < 0
+	  || add_field(object, &key_unit_name[1], rec->name, 0) < 0
+	  || add_field(object, &key_unit_scope[1], rec->isuser ? scope_user : scope_system, 0) < 0))
+		goto error;
+	return object;
+
+error:
+	json_object_put(object);
+	errno = ENOMEM;
+	return NULL;
 }
 
 /*
- * Adds the field of 'name' and 'value' in 'priv' and also if possible in 'pub'
- * Returns 0 on success or -1 on error.
+ * Get the private view of the application record 'rec'. The private
+ * view is kept because it is also used for recording runtime data.
+ * Being shared, it must only be used by the thread updating 'rec'.
+ * It returns a JSON-object that must be released using 'json_object_put'.
+ * Returns NULL in case of error.
  */
-static int add_fields_of_content(
-		struct json_object *priv,
-		struct json_object *pub,
-		char *content,
-		size_t length
-)
+static struct json_object *record_private(struct app_record *rec)
 {
-	char *name, *value, *read, *write;
+	if (rec->priv == NULL)
+		rec->priv = record_view(rec, 1);
+	return json_object_get(rec->priv);
+}
 
-	/* start at the beginning */
-	read = content;
-	for (;;) {
-		/* search the next key */
-		read = strstr(read, x_afm_prefix);
-		if (!read)
-			return 0;
+/*
+ * Get the public view of the application record 'rec'.
+ * It returns a JSON-object that must be released using 'json_object_put'.
+ * Returns NULL in case of error.
+ */
+static struct json_object *record_public(struct app_record *rec)
+{
+	return record_view(rec, 0);
+}
 
-		/* search to equal */
-		name = read + x_afm_prefix_length;
-		value = strchr(name, '=');
-		if (value == NULL)
-			read = name; /* not found */
-		else {
-			/* get the value (translate it) */
-			*value++ = 0;
-			read = write = value;
-			while(*read && *read != '\n') {
-				if (*read != '\\')
-					*write++ = *read++;
-				else {
-					switch(*++read) {
-					case 'n': *write++ = '\n'; break;
-					case '\n': *write++ = ' '; break;
-					default: *write++ = '\\'; *write++ = *read; break;
-					}
-					read += !!*read;
-				}
-			}
-			read += !!*read;
-			*write = 0;
+/*
+ * Adds to 'fields' the field of 'name' and 'value'.
+ * Returns 0 on success or -1 on error.
+ */
+static int fields_add(struct fields *fields, const char *name, const char *value)
+{
+	unsigned size;
+	const char *(*pairs)[2];
 
-			/* add the found field now */
-			if (add_field(priv, pub, name, value) < 0)
-				return -1;
+	if (fields->count == fields->size) {
+		size = fields->size ? 2 * fields->size : 32;
+		pairs = realloc(fields->pairs, size * sizeof *pairs);
+		if (pairs == NULL) {
+			errno = ENOMEM;
+			return -1;
 		}
+		fields->pairs = pairs;
+		fields->size = size;
 	}
+	fields->pairs[fields->count][0] = name;
+	fields->pairs[fields->count][1] = value;
+	fields->count++;
+	return 0;
 }
 
 /*
- * Adds the application widget 'desc' of the directory 'path' to the
- * afm_apps object 'apps'.
+ * Adds the application of the unit 'unitname' of path 'unitpath'
+ * and of X-AFM- 'fields' to the applications of 'updt'.
  * Returns 0 in case of success.
  * Returns -1 and set errno in case of error
  */
 static int addunit(
-		struct afm_apps *apps,
+		struct afm_updt *updt,
 		int isuser,
 		const char *unitpath,
 		const char *unitname,
-		char *content,
-		size_t length
+		const struct fields *fields
 )
 {
-	struct json_object *priv, *pub, *id, *visi;
-	const char *strid;
-	size_t len;
-
-	/* create the application structure */
-	priv = json_object_new_object();
-	if (!priv)
-		return -1;
+	struct app_record *rec;
+	struct app_field *field;
+	const char *name, *value, *visibility;
+	size_t len, size;
+	unsigned idx;
+	char *str;
 
-	pub = json_object_new_object();
-	if (!pub)
-		goto error;
-
-	/* make the unit name */
+	/* check the unit name */
 	len = strlen(unitname);
 	assert(len >= (sizeof service_extension - 1));
 	assert(!memcmp(&unitname[len - (sizeof service_extension - 1)], service_extension, sizeof service_extension));
 
-	/* adds the values */
-	if (add_fields_of_content(priv, pub, content, length)
-	 || add_field(priv, pub, key_unit_path, unitpath)
-	 || add_field(priv, pub, key_unit_name, unitname)
-	 || add_field(priv, pub, key_unit_scope, isuser ? scope_user : scope_system))
-		goto error;
+	/* allocate the record */
+	size = sizeof *rec + fields->count * sizeof *field + strlen(unitpath) + len + 2;
+	for (idx = 0 ; idx < fields->count ; idx++)
+		size += strlen(fields->pairs[idx][1]) + 1;
+	rec = malloc(size);
+	if (rec == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	rec->refcount = 1;
+	rec->count = fields->count;
+	rec->isuser = isuser;
+	rec->id = NULL;
+	visibility = NULL;
+	rec->priv = NULL;
+	rec->text = NULL;
+
+	/* set the strings */
+	str = (char*)&rec->fields[fields->count];
+	rec->path = str;
+	str = stpcpy(str, unitpath) + 1;
+	rec->name = str;
+	str = stpcpy(str, unitname) + 1;
+
+	/* set the fields */
+	for (idx = 0 ; idx < fields->count ; idx++) {
+		field = &rec->fields[idx];
+		name = fields->pairs[idx][0];
+		value = fields->pairs[idx][1];
+		field->flags = is_integer(value) ? FIELD_INTEGER : 0;
+		if (name[0] == '-') {
+			field->flags |= FIELD_PRIVATE;
+			name++;
+		}
+		field->name = intern(&updt->afudb->names, name);
+		if (field->name == NULL) {
+			free(rec);
+			errno = ENOMEM;
+			return -1;
+		}
+		field->value = str;
+		str = stpcpy(str, value) + 1;
+
+		/* first public id and first visibility */
+		if (rec->id == NULL && !(field->flags & FIELD_PRIVATE) && !strcmp(name, key_id))
+			rec->id = field->value;
+		if (visibility == NULL && !strcmp(name, key_visibility))
+			visibility = field->value;
+	}
+	rec->visible = visibility != NULL && !strcasecmp(visibility, value_visible);
 
-	/* get the id */
-	if (!json_object_object_get_ex(pub, key_id, &id)) {
+	/* check the id */
+	if (rec->id == NULL) {
+		free(rec);
 		errno = EINVAL;
-		goto error;
+		return -1;
 	}
-	strid = json_object_get_string(id);
 
 	/* record the application structure */
-	json_object_get(pub);
-	json_object_array_add(apps->publics.all, pub);
-	json_object_object_add(apps->publics.byname, strid, pub);
-	json_object_get(priv);
-	json_object_array_add(apps->privates.all, priv);
-	json_object_object_add(apps->privates.byname, strid, priv);
-
-	/* handle visibility */
-	if (json_object_object_get_ex(priv, key_visibility, &visi)
-		&& !strcasecmp(json_object_get_string(visi), value_visible)) {
-		json_object_array_add(apps->publics.visibles, json_object_get(pub));
-		json_object_array_add(apps->privates.visibles, json_object_get(priv));
-	}
+	return apps_add(&updt->applications, rec);
+}
 
-	return 0;
+/*
+ * Compares the records 'old' and 'new' of an application.
+ * Returns 1 if same or 0 if different.
+ */
+static int same_app(const struct app_record *old, const struct app_record *new)
+{
+	unsigned idx;
 
-error:
-	json_object_put(pub);
-	json_object_put(priv);
-	return -1;
+	if (old == new)
+		return 1;
+	if (old->count != new->count
+	 || old->isuser != new->isuser
+	 || strcmp(old->path, new->path)
+	 || strcmp(old->name, new->name))
+		return 0;
+	for (idx = 0 ; idx < old->count ; idx++)
+		if (old->fields[idx].name != new->fields[idx].name
+		 || old->fields[idx].flags != new->fields[idx].flags
+		 || strcmp(old->fields[idx].value, new->fields[idx].value))
+			return 0;
+	return 1;
 }
 
+
 /*
- * Crop and trim unit 'content' of 'length'. Return the new length.
+ * Computes in 'changes' the differences between the applications
+ * 'old' and 'new'. The result is an object with the 3 arrays of ids
+ * of the applications 'added', 'removed' and 'modified'.
+ * Returns the count of differences or -1 with errno = ENOMEM
+ * on memory depletion
  */
-static size_t crop_and_trim_unit_content(char *content, size_t length)
+static int apps_diff(struct afm_apps *old, struct afm_apps *new, struct json_object **changes)
 {
-	int st;
-	char c, *read, *write;
+	struct json_object *added, *removed, *modified;
+	struct app_record *rec, *val;
+	unsigned idx;
+	int count;
 
-	/* removes any comment and join continued lines */
-	st = 0;
-	read = write = content;
-	for (;;) {
-		do { c = *read++; } while (c == '\r');
-		if (!c)
-			break;
-		switch (st) {
-		case 0:
-			/* state 0: begin of a line */
-			if (c == ';' || c == '#') {
-				st = 3; /* removes lines starting with ; or # */
-				break;
-			}
-			if (c == '\n')
-				break; /* removes empty lines */
-enter_state_1:
-			st = 1;
-			/*@fallthrough@*/
-		case 1:
-			/* state 1: emitting a normal line */
-			if (c == '\\')
-				st = 2;
-			else {
-				*write++ = c;
-				if (c == '\n')
-					st = 0;
-			}
-			break;
-		case 2:
-			/* state 2: character after '\' */
-			if (c == '\n')
-				c = ' ';
-			else
-				*write++ = '\\';
-			goto enter_state_1;
-		case 3:
-			/* state 3: inside a comment, wait its end */
-			if (c == '\n')
-				st = 0;
-			break;
+	*changes = json_object_new_object();
+	if (*changes == NULL)
+		goto nomem;
+	added = j_add_new_array(*changes, key_added);
+	removed = j_add_new_array(*changes, key_removed);
+	modified = j_add_new_array(*changes, key_modified);
+	if (!added || !removed || !modified)
+		goto nomem;
+
+	count = 0;
+	for (idx = 0 ; idx < new->count ; idx++) {
+		rec = new->byname[idx].record;
+		if (idx + 1 < new->count && !strcmp(rec->id, new->byname[idx + 1].record->id))
+			continue; /* the last of the same id wins */
+		val = apps_get(old, rec->id);
+		if (val == NULL) {
+			if (!j_add_string(added, NULL, rec->id))
+				goto nomem;
+			count++;
+		}
+		else if (!same_app(val, rec)) {
+			if (!j_add_string(modified, NULL, rec->id))
+				goto nomem;
+			count++;
 		}
 	}
-	if (st == 1)
-		*write++ = '\n';
-	*write = 0;
-	return (size_t)(write - content);
+	for (idx = 0 ; idx < old->count ; idx++) {
+		rec = old->byname[idx].record;
+		if (idx + 1 < old->count && !strcmp(rec->id, old->byname[idx + 1].record->id))
+			continue;
+		if (apps_get(new, rec->id) == NULL) {
+			if (!j_add_string(removed, NULL, rec->id))
+				goto nomem;
+			count++;
+		}
+	}
+	return count;
+
+nomem:
+	json_object_put(*changes);
+	*changes = NULL;
+	errno = ENOMEM;
+	return -1;
 }
 
 /*
- * read a unit file
+ * Commits the applications of 'updt' to its database and computes,
+ * if 'changes' isn't NULL, the differences with the previous state.
+ * The generation is incremented if changes exist or are unknown.
+ * Returns the count of differences (0 when 'changes' is NULL)
+ * or -1 on memory depletion.
  */
-static int read_unit_file(const char *path, char **content, size_t *length)
+static int commit(struct afm_updt *updt, struct json_object **changes)
 {
-	int rc;
-	size_t nl;
+	struct afm_apps tmp;
+	int result;
 
-	/* read the file */
-	rc = rp_file_get(path, content, length);
-	if (rc >= 0) {
-		/* crop and trim it */
-		*length = nl = crop_and_trim_unit_content(*content, *length);
-		*content = realloc(*content, nl + 1);
+	/* index the applications */
+	if (apps_index(&updt->applications) < 0)
+		return -1;
+
+	/* compute the differences */
+	result = 0;
+	if (changes) {
+		result = apps_diff(&updt->afudb->applications, &updt->applications, changes);
+		if (result < 0)
+			return result;
 	}
-	return rc;
+
+	/* commit the result */
+	pthread_mutex_lock(&updt->afudb->lock);
+	tmp = updt->afudb->applications;
+	updt->afudb->applications = updt->applications;
+	updt->applications = tmp;
+	if (!changes || result)
+		updt->afudb->generation++;
+	pthread_mutex_unlock(&updt->afudb->lock);
+	return result;
 }
 
 /*
- * called for each unit
+ * Is the unit of 'name' managed by 'afudb'?
+ * Returns 1 if yes or 0 if not.
  */
-static int update_cb(void *closure, const char *name, const char *path, int isuser)
+static int is_managed_unit(struct afm_udb *afudb, const char *name)
 {
-	struct afm_updt *updt = closure;
-	char *content;
 	size_t length;
-	int rc;
 
 	/* prefix filtering */
-	length = updt->afudb->prefixlen;
-	if (length && strncmp(updt->afudb->prefix, name, length))
+	length = afudb->prefixlen;
+	if (length && strncmp(afudb->prefix, name, length))
 		return 0;
 
 	/* only services */
 	length = strlen(name);
-	if (length < service_extension_length || strcmp(service_extension, name + length - service_extension_length))
-		return 0;
+	return length >= service_extension_length
+		&& !strcmp(service_extension, name + length - service_extension_length);
+}
 
-	/* reads the file */
-	rc = read_unit_file(path, &content, &length);
-	if (rc < 0)
-		return 0;
+/*
+ * Appends to the snapshot 'snap' the 'length' bytes of 'data'
+ */
+static void snap_append(struct snapbuf *snap, const void *data, size_t length)
+{
+	size_t size;
+	char *buffer;
 
-	/* process the file */
-	rc = addunit(&updt->applications, isuser, path, name, content, length);
-	/* TODO: if (rc < 0)
-		RP_ERROR("Ignored boggus unit %s (error: %m)", path); */
-	free(content);
-	return 0;
+	if (snap->error)
+		return;
+	if (snap->length + length > snap->size) {
+		size = snap->size ? snap->size : 16384;
+		while (size < snap->length + length)
+			size <<= 1;
+		buffer = realloc(snap->data, size);
+		if (buffer == NULL) {
+			snap->error = ENOMEM;
+			return;
+		}
+		snap->data = buffer;
+		snap->size = size;
+	}
+	memcpy(&snap->data[snap->length], data, length);
+	snap->length += length;
 }
 
 /*
- * Creates an afm_udb object and returns it with one reference added.
- * Return NULL with errno = ENOMEM if memory exhausted.
+ * Appends to the snapshot 'snap' the string 'str' and its terminating zero
  */
-struct afm_udb *afm_udb_create(int sys, int usr, const char *prefix)
+static void snap_string(struct snapbuf *snap, const char *str)
 {
-	size_t length;
-	struct afm_udb *afudb;
+	snap_append(snap, str, strlen(str) + 1);
+}
 
-	length = prefix ? strlen(prefix) : 0;
-	afudb = malloc(length + sizeof * afudb);
-	if (afudb == NULL)
-		errno = ENOMEM;
-	else {
-		afudb->refcount = 1;
+/*
+ * Appends to the snapshot 'snap' the zeros needed to align its length
+ */
+static void snap_align(struct snapbuf *snap)
+{
+	static const char zeros[SNAP_ALIGN];
+	snap_append(snap, zeros, (SNAP_ALIGN - snap->length % SNAP_ALIGN) % SNAP_ALIGN);
+}
+
+/*
+ * Records in 'sst' the status 'st' or the absence of file if 'st' is NULL
+ */
+static void snap_stat_set(struct snap_stat *sst, const struct stat *st)
+{
+	if (st == NULL) {
+		memset(sst, 0, sizeof *sst);
+		sst->sec = -1;
+	}
+	else {
+		sst->ino = (uint64_t)st->st_ino;
+		sst->size = (uint64_t)st->st_size;
+		sst->sec = (int64_t)st->st_mtim.tv_sec;
+		sst->nsec = (int64_t)st->st_mtim.tv_nsec;
+	}
+}
+
+/*
+ * Records in 'sst' the status of the file of 'path'
+ */
+static void snap_stat_path(struct snap_stat *sst, const char *path)
+{
+	struct stat st;
+	snap_stat_set(sst, stat(path, &st) ? NULL : &st);
+}
+
+/*
+ * Appends to the snapshot 'snap' the record of the unit 'path'
+ * of status 'st' and having the 'fields'.
+ * Units modified since the scan began can't be trusted, this is
+ * the case when the modification time isn't before the stamp of 'head'.
+ */
+static void snap_add_unit(struct snapbuf *snap, int isuser, const char *path,
+				const struct stat *st, const struct fields *fields)
+{
+	struct snap_unit unit;
+	struct snap_head *head;
+	size_t begin;
+	unsigned idx;
+
+	if (snap->error)
+		return;
+	head = (struct snap_head*)snap->data;
+	if ((int64_t)st->st_mtim.tv_sec >= head->stamp) {
+		snap->error = EAGAIN;
+		return;
+	}
+
+	begin = snap->length;
+	memset(&unit, 0, sizeof unit);
+	unit.isuser = (uint32_t)!!isuser;
+	unit.npairs = fields->count;
+	snap_stat_set(&unit.stat, st);
+	snap_append(snap, &unit, sizeof unit);
+	snap_string(snap, path);
+	for (idx = 0 ; idx < fields->count ; idx++) {
+		snap_string(snap, fields->pairs[idx][0]);
+		snap_string(snap, fields->pairs[idx][1]);
+	}
+	snap_align(snap);
+	if (!snap->error) {
+		unit.size = (uint32_t)(snap->length - begin);
+		memcpy(&snap->data[begin], &unit.size, sizeof unit.size);
+		snap->count++;
+	}
+}
+
+/*
+ * Reads the unit of 'job' and gets its fields.
+ * The file is read and scanned twice: once for computing the size
+ * of the fields and once for copying them. Only the fields are kept,
+ * unescaped, the buffer of the file is released.
+ * This function is called from reading threads.
+ */
+static void job_load(struct unit_job *job, int withstat)
+{
+	struct unit_scan scan;
+	const char *content, *name, *value;
+	size_t length, nlen, vlen, size;
+	char *write;
+
+	/* read the file, status first to detect changes while reading */
+	job->error = 0;
+	job->content = NULL;
+	if (withstat && stat(job->path, &job->st) < 0)
+		job->error = errno;
+	if (unit_scan_read(job->path, &content, &length) < 0) {
+		job->error = errno;
+		return;
+	}
+
+	/* compute the size of the fields */
+	size = 1;
+	unit_scan_init(&scan, content, length, x_afm_prefix);
+	while (unit_scan_next(&scan, &name, &nlen, &value, &vlen))
+		size += nlen + vlen + 2;
+
+	/* copy the fields */
+	job->content = write = malloc(size);
+	if (write == NULL)
+		job->error = ENOMEM;
+	else {
+		job->fields.count = 0;
+		unit_scan_init(&scan, content, length, x_afm_prefix);
+		while (unit_scan_next(&scan, &name, &nlen, &value, &vlen)) {
+			memcpy(write, name, nlen);
+			write[nlen] = 0;
+			if (fields_add(&job->fields, write, &write[nlen + 1]) < 0) {
+				job->error = errno;
+				free(job->content);
+				job->content = NULL;
+				break;
+			}
+			write += nlen + 1;
+			write += unit_scan_unescape(write, value, vlen) + 1;
+		}
+	}
+	unit_scan_release(content, length);
+}
+
+/*
+ * Adds to 'updt' the application of the unit read by 'job'
+ */
+static void job_add(struct afm_updt *updt, struct unit_job *job)
+{
+	int rc;
+
+	if (job->error && updt->snap)
+		updt->snap->error = job->error;
+	if (job->content == NULL)
+		return;
+	if (updt->snap)
+		snap_add_unit(updt->snap, job->isuser, job->path, &job->st, &job->fields);
+	rc = addunit(updt, job->isuser, job->path, job->name, &job->fields);
+	/* TODO: if (rc < 0)
+		RP_ERROR("Ignored boggus unit %s (error: %m)", path); */
+	(void)rc;
+}
+
+/*
+ * Releases the memory used by 'job'
+ */
+static void job_release(struct unit_job *job)
+{
+	free(job->content);
+	free(job->fields.pairs);
+	free(job->path);
+}
+
+/*
+ * called for each unit
+ */
+static int update_cb(void *closure, const char *name, const char *path, int isuser)
+{
+	struct afm_updt *updt = closure;
+	struct unit_job job;
+
+	/* filtering */
+	if (!is_managed_unit(updt->afudb, name))
+		return 0;
+
+	/* process the file */
+	memset(&job, 0, sizeof job);
+	job.name = name;
+	job.isuser = isuser;
+	job.path = (char*)path;
+	job_load(&job, updt->snap != NULL);
+	job_add(updt, &job);
+	job.path = NULL;
+	job_release(&job);
+	return 0;
+}
+
+/*
+ * called for each unit when listing the units to read
+ */
+static int list_cb(void *closure, const char *name, const char *path, int isuser)
+{
+	struct unit_jobs *jobs = closure;
+	struct unit_job *job;
+	unsigned size;
+
+	/* filtering */
+	if (!is_managed_unit(jobs->afudb, name))
+		return 0;
+
+	/* record the job */
+	if (jobs->count == jobs->size) {
+		size = jobs->size ? 2 * jobs->size : 64;
+		job = realloc(jobs->jobs, size * sizeof *job);
+		if (job == NULL)
+			goto nomem;
+		jobs->jobs = job;
+		jobs->size = size;
+	}
+	job = &jobs->jobs[jobs->count];
+	memset(job, 0, sizeof *job);
+	job->path = strdup(path);
+	if (job->path == NULL)
+		goto nomem;
+	job->name = &job->path[strlen(path) - strlen(name)];
+	job->isuser = isuser;
+	jobs->count++;
+	return 0;
+
+nomem:
+	errno = ENOMEM;
+	return -1;
+}
+
+/*
+ * Reads the jobs of 'jobs' until none remains.
+ * This function is the body of the reading threads.
+ */
+static void *jobs_worker(void *closure)
+{
+	struct unit_jobs *jobs = closure;
+	unsigned idx;
+
+	while ((idx = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->count)
+		job_load(&jobs->jobs[idx], jobs->withstat);
+	return NULL;
+}
+
+/*
+ * Reads the units of 'jobs' using threads when there are enough units.
+ * The calling thread is also reading units.
+ */
+static void jobs_run(struct unit_jobs *jobs)
+{
+	pthread_t tids[AFM_UDB_THREADS];
+	sigset_t all, saved;
+	long ncpu;
+	int idx, nthr;
+
+	/* compute the count of threads */
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthr = (int)(jobs->count / AFM_UDB_UNITS_PER_THREAD);
+	if (nthr > ncpu)
+		nthr = (int)ncpu;
+	if (nthr > AFM_UDB_THREADS)
+		nthr = AFM_UDB_THREADS;
+
+	/* start the threads with signals blocked */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	for (idx = 1 ; idx < nthr ; idx++)
+		if (pthread_create(&tids[idx], NULL, jobs_worker, jobs) != 0)
+			break;
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	nthr = idx;
+
+	/* work and wait the end of the threads */
+	jobs_worker(jobs);
+	for (idx = 1 ; idx < nthr ; idx++)
+		pthread_join(tids[idx], NULL);
+}
+
+/*
+ * Reads the units of 'updt' and adds their applications
+ * Returns 0 on success or -1 on error.
+ */
+static int update_all(struct afm_updt *updt)
+{
+	struct unit_jobs jobs;
+	unsigned idx;
+	int rc;
+
+	/* list the units */
+	memset(&jobs, 0, sizeof jobs);
+	jobs.afudb = updt->afudb;
+	jobs.withstat = updt->snap != NULL;
+	rc = 0;
+	if (updt->afudb->user)
+		rc = units_fs_list(1, list_cb, &jobs, 1);
+	if (rc >= 0 && updt->afudb->system)
+		rc = units_fs_list(0, list_cb, &jobs, 1);
+
+	/* read the units */
+	if (rc >= 0)
+		jobs_run(&jobs);
+
+	/* add the applications in the order of the listing */
+	for (idx = 0 ; idx < jobs.count ; idx++) {
+		if (rc >= 0)
+			job_add(updt, &jobs.jobs[idx]);
+		job_release(&jobs.jobs[idx]);
+	}
+	free(jobs.jobs);
+	return rc;
+}
+
+/*
+ * Initialize in 'snap' a snapshot of the units of 'afudb'
+ */
+static void snap_begin(struct snapbuf *snap, struct afm_udb *afudb)
+{
+	struct snap_head head;
+	char path[PATH_MAX + 1];
+	size_t begin;
+	int isuser;
+
+	memset(snap, 0, sizeof *snap);
+	memset(&head, 0, sizeof head);
+	head.magic = SNAP_MAGIC;
+	head.flags = (afudb->system ? SNAP_SYSTEM : 0) | (afudb->user ? SNAP_USER : 0);
+	head.stamp = (int64_t)time(NULL);
+	snap_append(snap, &head, sizeof head);
+	begin = snap->length;
+	snap_string(snap, afudb->prefix);
+	for (isuser = 0 ; isuser <= 1 ; isuser++) {
+		if (units_fs_get_afm_units_dir(path, sizeof path, isuser) < 0)
+			snap->error = errno;
+		else {
+			snap_string(snap, path);
+			if (!snap->error)
+				snap_stat_path(&((struct snap_head*)snap->data)->dirs[isuser], path);
+		}
+	}
+	snap_align(snap);
+	if (!snap->error)
+		((struct snap_head*)snap->data)->length = (uint32_t)(snap->length - begin);
+}
+
+/*
+ * Writes the snapshot 'snap' of 'afudb' if possible
+ */
+static void snap_end(struct snapbuf *snap, struct afm_udb *afudb)
+{
+	char *tmp, *slash;
+	ssize_t wrc;
+	size_t off;
+	int fd;
+
+	if (snap->error == 0) {
+		((struct snap_head*)snap->data)->count = snap->count;
+		tmp = malloc(strlen(afudb->snapshot) + 5);
+		if (tmp != NULL) {
+			strcpy(stpcpy(tmp, afudb->snapshot), ".tmp");
+			fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+			if (fd < 0 && errno == ENOENT) {
+				/* creates the directory, one level only */
+				slash = strrchr(tmp, '/');
+				if (slash != NULL && slash != tmp) {
+					*slash = 0;
+					mkdir(tmp, 0755);
+					*slash = '/';
+					fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+				}
+			}
+			if (fd >= 0) {
+				for (off = 0 ; off < snap->length ; off += (size_t)wrc) {
+					wrc = write(fd, &snap->data[off], snap->length - off);
+					if (wrc < 0 && errno != EINTR)
+						break;
+					if (wrc < 0)
+						wrc = 0;
+				}
+				close(fd);
+				if (off < snap->length || rename(tmp, afudb->snapshot) < 0)
+					unlink(tmp);
+			}
+			free(tmp);
+		}
+	}
+	free(snap->data);
+}
+
+/*
+ * Is the status 'sst' matching the status 'st', or no file when NULL?
+ * Returns 1 if yes or 0 if not.
+ */
+static int snap_stat_match(const struct snap_stat *sst, const struct stat *st)
+{
+	struct snap_stat cur;
+
+	snap_stat_set(&cur, st);
+	return cur.ino == sst->ino && cur.size == sst->size
+		&& cur.sec == sst->sec && cur.nsec == sst->nsec;
+}
+
+/*
+ * Is the file of 'path' matching the status 'sst'
+ * and not modified after the time 'stamp'?
+ * Returns 1 if yes or 0 if not.
+ */
+static int snap_check_path(const struct snap_stat *sst, const char *path, int64_t stamp)
+{
+	struct stat st;
+
+	return sst->sec < stamp
+		&& snap_stat_match(sst, stat(path, &st) ? NULL : &st);
+}
+
+/*
+ * Gets in 'str' the string at 'offset' of 'data' of 'length'
+ * and returns the offset after the string or 0 if no string is there.
+ */
+static size_t snap_get_string(const char *data, size_t offset, size_t length, const char **str)
+{
+	const char *end;
+
+	if (offset >= length)
+		return 0;
+	end = memchr(&data[offset], 0, length - offset);
+	if (end == NULL)
+		return 0;
+	*str = &data[offset];
+	return (size_t)(end - data) + 1;
+}
+
+/*
+ * Reads the applications of 'updt' from the snapshot 'data' of 'length'
+ * Returns 0 on success or -1 if the snapshot doesn't match the files.
+ */
+static int snap_read(struct afm_updt *updt, const char *data, size_t length)
+{
+	struct snap_head head;
+	struct snap_unit unit;
+	struct afm_udb *afudb = updt->afudb;
+	const char *str, *path, *name, *value;
+	char dir[PATH_MAX + 1];
+	size_t off, end;
+	unsigned idx, count;
+	int isuser;
+
+	/* check the header */
+	if (length < sizeof head)
+		return -1;
+	memcpy(&head, data, sizeof head);
+	off = sizeof head;
+	end = off + head.length;
+	if (head.magic != SNAP_MAGIC
+	 || head.flags != ((afudb->system ? SNAP_SYSTEM : 0) | (afudb->user ? SNAP_USER : 0))
+	 || end > length
+	 || !(off = snap_get_string(data, off, end, &str))
+	 || strcmp(str, afudb->prefix))
+		return -1;
+	for (isuser = 0 ; isuser <= 1 ; isuser++) {
+		if (!(off = snap_get_string(data, off, end, &str))
+		 || units_fs_get_afm_units_dir(dir, sizeof dir, isuser) < 0
+		 || strcmp(str, dir)
+		 || !snap_check_path(&head.dirs[isuser], dir, head.stamp))
+			return -1;
+	}
+
+	/* read the units */
+	off = end;
+	for (count = 0 ; count < head.count ; count++) {
+		if (length - off < sizeof unit)
+			return -1;
+		memcpy(&unit, &data[off], sizeof unit);
+		if (unit.size < sizeof unit
+		 || unit.size % SNAP_ALIGN
+		 || unit.size > length - off)
+			return -1;
+		end = off + unit.size;
+		off += sizeof unit;
+		if (!(off = snap_get_string(data, off, end, &path))
+		 || !snap_check_path(&unit.stat, path, head.stamp))
+			return -1;
+		updt->fields.count = 0;
+		for (idx = 0 ; idx < unit.npairs ; idx++) {
+			if (!(off = snap_get_string(data, off, end, &name))
+			 || !(off = snap_get_string(data, off, end, &value))
+			 || fields_add(&updt->fields, name, value) < 0)
+				return -1;
+		}
+		str = strrchr(path, '/');
+		str = str ? str + 1 : path;
+		addunit(updt, (int)unit.isuser, path, str, &updt->fields);
+		off = end;
+	}
+	return off == length ? 0 : -1;
+}
+
+/*
+ * Loads the applications of 'afudb' from its snapshot
+ * Returns 0 on success or -1 if the snapshot can't be used.
+ */
+static int snap_load(struct afm_udb *afudb)
+{
+	struct afm_updt updt;
+	struct stat st;
+	void *data;
+	size_t length;
+	int fd, rc;
+
+	/* map the snapshot */
+	fd = open(afudb->snapshot, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	rc = fstat(fd, &st);
+	length = (size_t)st.st_size;
+	data = rc < 0 || length == 0 ? MAP_FAILED
+		: mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+
+	/* read it */
+	memset(&updt, 0, sizeof updt);
+	updt.afudb = afudb;
+	if (!apps_init(&updt.applications))
+		rc = -1;
+	else {
+		rc = snap_read(&updt, data, length);
+		if (rc >= 0)
+			rc = commit(&updt, NULL);
+		apps_put(&updt.applications);
+	}
+	free(updt.fields.pairs);
+	munmap(data, length);
+	return rc;
+}
+
+/*
+ * Creates an afm_udb object and returns it with one reference added.
+ * When 'snapshot' isn't NULL, it is the path of the file used to
+ * record the scanned units for speeding up next creations.
+ * Return NULL with errno = ENOMEM if memory exhausted.
+ */
+struct afm_udb *afm_udb_create(int sys, int usr, const char *prefix, const char *snapshot)
+{
+	size_t length;
+	struct afm_udb *afudb;
+
+	length = prefix ? strlen(prefix) : 0;
+	afudb = malloc(length + sizeof * afudb);
+	if (afudb == NULL)
+		errno = ENOMEM;
+	else {
+		afudb->refcount = 1;
 		memset(&afudb->applications, 0, sizeof afudb->applications);
+		pthread_mutex_init(&afudb->lock, NULL);
 		afudb->system = sys;
 		afudb->user = usr;
+		afudb->watchfd = -1;
+		afudb->watchsys = -1;
+		afudb->watchusr = -1;
+		afudb->generation = 0;
+		memset(&afudb->names, 0, sizeof afudb->names);
+		afudb->snapshot = NULL;
 		afudb->prefixlen = length;
 		if (length)
 			memcpy(afudb->prefix, prefix, length);
 		afudb->prefix[length] = 0;
-		if (afm_udb_update(afudb) < 0) {
+		if (snapshot != NULL && (afudb->snapshot = strdup(snapshot)) == NULL) {
+			errno = ENOMEM;
+			afm_udb_unref(afudb);
+			afudb = NULL;
+		}
+		else if ((afudb->snapshot == NULL || snap_load(afudb) < 0)
+		      && afm_udb_update(afudb, NULL) < 0) {
 			afm_udb_unref(afudb);
 			afudb = NULL;
 		}
@@ -479,48 +1520,286 @@ void afm_udb_unref(struct afm_udb *afudb)
 	if (!--afudb->refcount) {
 		/* no more reference, clean the memory used by the object */
 		apps_put(&afudb->applications);
+		if (afudb->watchfd >= 0)
+			close(afudb->watchfd);
+		intern_put(&afudb->names);
+		pthread_mutex_destroy(&afudb->lock);
+		free(afudb->snapshot);
 		free(afudb);
 	}
 }
 
 /*
  * Regenerate the list of applications of the afm_bd object 'afudb'.
- * Returns 0 in case of success.
+ * If 'changes' isn't NULL, it receives an object describing the
+ * ids of the applications 'added', 'removed' and 'modified'. That
+ * object must be released using 'json_object_put'.
+ * Returns the count of changes in case of success (always 0 when
+ * 'changes' is NULL).
  * Returns -1 and set errno in case of error
  */
-int afm_udb_update(struct afm_udb *afudb)
+int afm_udb_update(struct afm_udb *afudb, struct json_object **changes)
 {
 	struct afm_updt updt;
-	struct afm_apps tmp;
+	struct snapbuf snap;
 	int result;
 
 	/* lock the db */
+	if (changes)
+		*changes = NULL;
 	afm_udb_addref(afudb);
+	memset(&updt, 0, sizeof updt);
 	updt.afudb = afudb;
 
 	/* create the apps */
 	if (!apps_init(&updt.applications))
 		result = -1;
 	else {
+		/* prepare the snapshot */
+		if (afudb->snapshot != NULL) {
+			updt.snap = &snap;
+			snap_begin(&snap, afudb);
+		}
 		/* scan the units */
-		if (afudb->user && units_fs_list(1, update_cb, &updt, 1) < 0)
-			result = -1;
-		else if (afudb->system && units_fs_list(0, update_cb, &updt, 1) < 0)
+		if (update_all(&updt) < 0)
 			result = -1;
-		else {
+		else
+			result = commit(&updt, changes);
+		/* record the snapshot */
+		if (updt.snap != NULL) {
+			if (result < 0)
+				snap.error = errno;
+			snap_end(&snap, afudb);
+		}
+		apps_put(&updt.applications);
+	}
+	/* unlock the db and return status */
+	free(updt.fields.pairs);
+	afm_udb_unref(afudb);
+	return result;
+}
+
+/*
+ * Updates the applications of 'afudb' for the units whose paths are
+ * the keys of the object 'changes'. The values of 'changes' are booleans
+ * telling if the unit is a user unit.
+ * Only the units of 'changes' are read, others are kept as is.
+ * See 'afm_udb_update' for the meaning of 'diff' and of the result.
+ */
+static int update_units(struct afm_udb *afudb, struct json_object *changes, struct json_object **diff)
+{
+	struct afm_updt updt;
+	struct app_record *rec;
+	struct json_object_iter i;
+	struct json_object *val;
+	const char *name;
+	unsigned idx;
+	int result;
+
+	/* lock the db */
+	afm_udb_addref(afudb);
+	memset(&updt, 0, sizeof updt);
+	updt.afudb = afudb;
+
+	/* create the apps */
+	if (!apps_init(&updt.applications))
+		result = -1;
+	else {
+		/* keep the applications of unchanged units and read again,
+		 * at the same place, the changed ones */
+		result = 0;
+		for (idx = 0 ; result >= 0 && idx < afudb->applications.count ; idx++) {
+			rec = afudb->applications.all[idx];
+			if (json_object_object_get_ex(changes, rec->path, &val)) {
+				update_cb(&updt, rec->name, rec->path, json_object_get_boolean(val));
+				json_object_object_del(changes, rec->path);
+			}
+			else {
+				rec->refcount++;
+				result = apps_add(&updt.applications, rec);
+			}
+		}
+
+		/* read the new units, removed ones are ignored */
+		if (result >= 0) {
+			json_object_object_foreachC(changes, i) {
+				name = strrchr(i.key, '/');
+				name = name ? name + 1 : i.key;
+				update_cb(&updt, name, i.key, json_object_get_boolean(i.val));
+			}
+
 			/* commit the result */
-			tmp = afudb->applications;
-			afudb->applications = updt.applications;
-			updt.applications = tmp;
-			result = 0;
+			result = commit(&updt, diff);
 		}
 		apps_put(&updt.applications);
 	}
 	/* unlock the db and return status */
+	free(updt.fields.pairs);
 	afm_udb_unref(afudb);
 	return result;
 }
 
+/*
+ * Adds to the inotify of 'afudb' the watch of the units of 'isuser'.
+ * Only the completed units are watched: closed after write or moved in.
+ * Returns the watch descriptor or -1 when the directory can't be watched.
+ */
+static int watch_units_dir(struct afm_udb *afudb, int isuser)
+{
+	char path[PATH_MAX + 1];
+	int wd;
+
+	wd = units_fs_get_afm_units_dir(path, sizeof path, isuser);
+	if (wd >= 0)
+		wd = inotify_add_watch(afudb->watchfd, path,
+				IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM
+				| IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF
+				| IN_ONLYDIR);
+	return wd;
+}
+
+/*
+ * (Re)set the watches of the directories managed by 'afudb'
+ */
+static void watch_units_dirs(struct afm_udb *afudb)
+{
+	if (afudb->watchsys >= 0)
+		inotify_rm_watch(afudb->watchfd, afudb->watchsys);
+	if (afudb->watchusr >= 0)
+		inotify_rm_watch(afudb->watchfd, afudb->watchusr);
+	afudb->watchsys = afudb->system ? watch_units_dir(afudb, 0) : -1;
+	afudb->watchusr = afudb->user ? watch_units_dir(afudb, 1) : -1;
+}
+
+/*
+ * Watches the directories of the units of 'afudb' for being able
+ * to refresh incrementally the applications using 'afm_udb_watch_process'.
+ * Returns the file descriptor to be polled for input or, in case of error,
+ * returns -1 and set errno.
+ */
+int afm_udb_watch(struct afm_udb *afudb)
+{
+	if (afudb->watchfd < 0) {
+		afudb->watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (afudb->watchfd >= 0)
+			watch_units_dirs(afudb);
+	}
+	return afudb->watchfd;
+}
+
+/*
+ * Processes the pending events of the watched directories of 'afudb'
+ * and refresh the applications of the units that changed.
+ * When a directory can't be watched or when events were lost,
+ * all the units are read again.
+ * If 'diff' isn't NULL, it receives, when applications changed, the
+ * object describing the changes as for 'afm_udb_update'.
+ * Returns 1 if applications changed, 0 if nothing changed or,
+ * in case of error, returns -1 and set errno.
+ */
+int afm_udb_watch_process(struct afm_udb *afudb, struct json_object **diff)
+{
+	char buffer[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX + 1];
+	const struct inotify_event *evt;
+	struct json_object *changes, *delta;
+	ssize_t len;
+	size_t off;
+	int rc, full, isuser;
+
+	if (diff)
+		*diff = NULL;
+	if (afudb->watchfd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	/* some directory not watched? */
+	full = (afudb->system && afudb->watchsys < 0)
+		|| (afudb->user && afudb->watchusr < 0);
+
+	/* read the pending events */
+	changes = json_object_new_object();
+	if (changes == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (;;) {
+		len = read(afudb->watchfd, buffer, sizeof buffer);
+		if (len <= 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		for (off = 0 ; off < (size_t)len ; off += sizeof *evt + evt->len) {
+			evt = (const struct inotify_event*)&buffer[off];
+			if (evt->mask & IN_Q_OVERFLOW)
+				full = 1;
+			else if (evt->wd != afudb->watchsys && evt->wd != afudb->watchusr)
+				continue; /* obsolete watch */
+			else if (evt->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+				full = 1;
+			else if (evt->len && is_managed_unit(afudb, evt->name)) {
+				isuser = evt->wd == afudb->watchusr;
+				rc = units_fs_get_afm_units_dir(path, sizeof path, isuser);
+				if (rc >= 0 && (size_t)rc + strlen(evt->name) + 1 < sizeof path) {
+					path[rc] = '/';
+					strcpy(&path[rc + 1], evt->name);
+					json_object_object_add(changes, path, json_object_new_boolean(isuser));
+				}
+			}
+		}
+	}
+
+	/* apply the changes */
+	delta = NULL;
+	if (full) {
+		/* watch again the directories and rescan all */
+		watch_units_dirs(afudb);
+		rc = afm_udb_update(afudb, &delta);
+	}
+	else if (json_object_object_length(changes) == 0)
+		rc = 0;
+	else
+		rc = update_units(afudb, changes, &delta);
+	json_object_put(changes);
+
+	/* return the changes */
+	if (rc > 0 && diff)
+		*diff = delta;
+	else
+		json_object_put(delta);
+	return rc < 0 ? -1 : rc > 0;
+}
+
+/*
+ * Get the list of the views of the applications of 'apps'.
+ * The list is returned as a JSON-array that must be released using
+ * 'json_object_put'.
+ * Returns NULL in case of error.
+ */
+static struct json_object *apps_list(struct afm_apps *apps, int all, int priv)
+{
+	struct json_object *result, *view;
+	struct app_record *rec;
+	unsigned idx;
+
+	result = json_object_new_array();
+	for (idx = 0 ; result != NULL && idx < apps->count ; idx++) {
+		rec = apps->all[idx];
+		if (all || rec->visible) {
+			view = priv ? record_private(rec) : record_public(rec);
+			if (view == NULL || json_object_array_add(result, view) < 0) {
+				json_object_put(view);
+				json_object_put(result);
+				result = NULL;
+			}
+		}
+	}
+	return result;
+}
+
 /*
  * Get the list of the applications private data of the afm_udb object 'afudb'.
  * The list is returned as a JSON-array that must be released using
@@ -529,7 +1808,12 @@ int afm_udb_update(struct afm_udb *afudb)
  */
 struct json_object *afm_udb_applications_private(struct afm_udb *afudb, int all, int uid)
 {
-	return json_object_get(all ? afudb->applications.privates.all : afudb->applications.privates.visibles);
+	struct json_object *result;
+
+	pthread_mutex_lock(&afudb->lock);
+	result = apps_list(&afudb->applications, all, 1);
+	pthread_mutex_unlock(&afudb->lock);
+	return result;
 }
 
 /*
@@ -540,31 +1824,241 @@ struct json_object *afm_udb_applications_private(struct afm_udb *afudb, int all,
  */
 struct json_object *afm_udb_applications_public(struct afm_udb *afudb, int all, int uid)
 {
-	return json_object_get(all ? afudb->applications.publics.all : afudb->applications.publics.visibles);
+	struct json_object *result;
+
+	pthread_mutex_lock(&afudb->lock);
+	result = apps_list(&afudb->applications, all, 0);
+	pthread_mutex_unlock(&afudb->lock);
+	return result;
 }
 
 /*
- * Get the private data of the applications of 'id' in the afm_udb object 'afudb'.
- * It returns a JSON-object that must be released using 'json_object_put'.
+ * Get the generation of the applications of the afm_udb object 'afudb'.
+ * The generation changes each time the applications change.
+ */
+unsigned afm_udb_generation(struct afm_udb *afudb)
+{
+	unsigned result;
+
+	pthread_mutex_lock(&afudb->lock);
+	result = afudb->generation;
+	pthread_mutex_unlock(&afudb->lock);
+	return result;
+}
+
+/*
+ * Creates a shared text of the 'length' first characters of 'string'.
+ * Returns the text with one reference or NULL with errno = ENOMEM.
+ */
+struct afm_udb_text *afm_udb_text_create(const char *string, size_t length)
+{
+	struct afm_udb_text *text;
+
+	text = malloc(sizeof *text + length + 1);
+	if (text == NULL)
+		errno = ENOMEM;
+	else {
+		text->refcount = 1;
+		text->length = length;
+		memcpy(text->string, string, length);
+		text->string[length] = 0;
+	}
+	return text;
+}
+
+/*
+ * Adds a reference to the shared 'text'.
+ * Returns 'text'.
+ */
+struct afm_udb_text *afm_udb_text_addref(struct afm_udb_text *text)
+{
+	if (text)
+		__atomic_add_fetch(&text->refcount, 1, __ATOMIC_RELAXED);
+	return text;
+}
+
+/*
+ * Removes a reference to the shared 'text', releasing it on the last one.
+ */
+void afm_udb_text_unref(struct afm_udb_text *text)
+{
+	if (text && !__atomic_sub_fetch(&text->refcount, 1, __ATOMIC_ACQ_REL))
+		free(text);
+}
+
+/*
+ * Get the zero terminated string of the shared 'text'.
+ */
+const char *afm_udb_text_string(const struct afm_udb_text *text)
+{
+	return text->string;
+}
+
+/*
+ * Get the length of the string of the shared 'text'.
+ */
+size_t afm_udb_text_length(const struct afm_udb_text *text)
+{
+	return text->length;
+}
+
+/*
+ * Creates the shared text serializing 'object'.
+ * The reference of 'object' is released.
+ * Returns the text or NULL in case of error.
+ */
+static struct afm_udb_text *serialize(struct json_object *object)
+{
+	struct afm_udb_text *result;
+	const char *text;
+	size_t length;
+
+	result = NULL;
+	if (object != NULL) {
+		text = json_object_to_json_string_length(object, JSON_C_TO_STRING_PLAIN, &length);
+		if (text)
+			result = afm_udb_text_create(text, length);
+		json_object_put(object);
+	}
+	return result;
+}
+
+/*
+ * Get in 'cache' the serialization of 'object', computing it if needed.
+ * The reference of 'object' is released.
+ * Returns a new reference of the cached text or NULL in case of error.
+ */
+static struct afm_udb_text *get_text(struct afm_udb_text **cache, struct json_object *object)
+{
+	if (*cache == NULL)
+		*cache = serialize(object);
+	else
+		json_object_put(object);
+	return afm_udb_text_addref(*cache);
+}
+
+/*
+ * Get the list of the applications public data of the afm_udb object 'afudb'
+ * already serialized. The serialization is shared until the applications
+ * change.
+ * The serialization is returned as a text that must be released using
+ * 'afm_udb_text_unref'. When 'generation' isn't NULL, it receives the
+ * generation of the applications serialized.
  * Returns NULL in case of error.
  */
-static struct json_object *get_no_case(struct json_object *object, const char *id, int uid)
+struct afm_udb_text *afm_udb_applications_public_text(struct afm_udb *afudb, int all, int uid, unsigned *generation)
 {
-	struct json_object *result;
-	struct json_object_iter i;
+	struct afm_apps *apps = &afudb->applications;
+	struct afm_udb_text **cache = all ? &apps->texts.all : &apps->texts.visibles;
+	struct afm_udb_text *result;
 
-	/* search case sensitively */
-	if (json_object_object_get_ex(object, id, &result))
-		return json_object_get(result);
+	pthread_mutex_lock(&afudb->lock);
+	result = get_text(cache, *cache ? NULL : apps_list(apps, all, 0));
+	if (generation)
+		*generation = afudb->generation;
+	pthread_mutex_unlock(&afudb->lock);
+	return result;
+}
 
-	/* fallback to a case insensitive search */
-	json_object_object_foreachC(object, i) {
-		if (!strcasecmp(i.key, id))
-			return json_object_get(i.val);
+/*
+ * Does the application record 'rec' have the public field 'name' of 'value'?
+ * Returns 1 if yes or 0 if not.
+ */
+static int record_has(const struct app_record *rec, const char *name, const char *value)
+{
+	const struct app_field *field;
+	unsigned idx;
+
+	for (idx = 0 ; idx < rec->count ; idx++) {
+		field = &rec->fields[idx];
+		if (!(field->flags & FIELD_PRIVATE)
+		 && !strcmp(field->name, name)
+		 && !strcmp(field->value, value))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Creates the JSON view of the public fields of 'names' of the
+ * application record 'rec'.
+ * Returns the created object or NULL with errno = ENOMEM.
+ */
+static struct json_object *record_projection(const struct app_record *rec,
+			const char * const names[], unsigned nnames)
+{
+	struct json_object *object;
+	const struct app_field *field;
+	unsigned idx, i;
+
+	object = json_object_new_object();
+	if (object == NULL)
+		goto error;
+	for (idx = 0 ; idx < rec->count ; idx++) {
+		field = &rec->fields[idx];
+		if (!(field->flags & FIELD_PRIVATE)) {
+			for (i = 0 ; i < nnames && strcmp(field->name, names[i]) ; i++);
+			if (i < nnames
+			 && add_field(object, field->name, field->value, field->flags & FIELD_INTEGER) < 0)
+				goto error;
+		}
 	}
+	return object;
+
+error:
+	json_object_put(object);
+	errno = ENOMEM;
 	return NULL;
 }
 
+/*
+ * Get the list of the applications public data of the afm_udb object 'afudb'
+ * restricted to the fields of 'names' (all when 'names' is NULL) of the
+ * applications having the fields of 'filters', pairs of name and value.
+ * The list is returned serialized as a text that must be released
+ * using 'afm_udb_text_unref'.
+ * When 'generation' isn't NULL, it receives the generation of the
+ * applications listed.
+ * Returns NULL in case of error, with errno = EINVAL when a name or
+ * a value of 'filters' is NULL.
+ */
+struct afm_udb_text *afm_udb_applications_projected_text(struct afm_udb *afudb, int all, int uid,
+			const char * const names[], unsigned nnames,
+			const char * const (*filters)[2], unsigned nfilters,
+			unsigned *generation)
+{
+	struct json_object *list, *view;
+	struct app_record *rec;
+	unsigned idx, i;
+
+	/* check the filters */
+	for (i = 0 ; i < nfilters ; i++) {
+		if (filters[i][0] == NULL || filters[i][1] == NULL) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	list = json_object_new_array();
+	pthread_mutex_lock(&afudb->lock);
+	if (generation)
+		*generation = afudb->generation;
+	for (idx = 0 ; list != NULL && idx < afudb->applications.count ; idx++) {
+		rec = afudb->applications.all[idx];
+		for (i = 0 ; i < nfilters && record_has(rec, filters[i][0], filters[i][1]) ; i++);
+		if ((all || rec->visible) && i == nfilters) {
+			view = names ? record_projection(rec, names, nnames) : record_public(rec);
+			if (view == NULL || json_object_array_add(list, view) < 0) {
+				json_object_put(view);
+				json_object_put(list);
+				list = NULL;
+			}
+		}
+	}
+	pthread_mutex_unlock(&afudb->lock);
+	return serialize(list);
+}
+
 /*
  * Get the private data of the applications of 'id' in the afm_udb object 'afudb'.
  * It returns a JSON-object that must be released using 'json_object_put'.
@@ -572,7 +2066,61 @@ static struct json_object *get_no_case(struct json_object *object, const char *i
  */
 struct json_object *afm_udb_get_application_private(struct afm_udb *afudb, const char *id, int uid)
 {
-	return get_no_case(afudb->applications.privates.byname, id, uid);
+	struct app_record *rec;
+	struct json_object *result;
+
+	pthread_mutex_lock(&afudb->lock);
+	rec = apps_search(&afudb->applications, id);
+	result = rec ? record_private(rec) : NULL;
+	pthread_mutex_unlock(&afudb->lock);
+	return result;
+}
+
+/*
+ * Get the id of the application whose unit is of name 'unit' in the
+ * afm_udb object 'afudb' and, when 'isuser' isn't NULL, the scope of
+ * the unit. Unlike the private data, it doesn't create views.
+ * Returns the id to be freed by the caller or NULL if not found.
+ */
+char *afm_udb_get_id_of_unit(struct afm_udb *afudb, const char *unit, int *isuser)
+{
+	unsigned idx;
+	struct afm_apps *apps = &afudb->applications;
+	char *result;
+
+	result = NULL;
+	pthread_mutex_lock(&afudb->lock);
+	for (idx = 0 ; idx < apps->count && strcmp(apps->all[idx]->name, unit) ; idx++);
+	if (idx < apps->count) {
+		result = strdup(apps->all[idx]->id);
+		if (isuser)
+			*isuser = apps->all[idx]->isuser;
+	}
+	pthread_mutex_unlock(&afudb->lock);
+	return result;
+}
+
+/*
+ * Calls 'callback' for the applications of the afm_udb object 'afudb',
+ * all or only visible ones, with their id and the name and the scope
+ * of their unit. Unlike the private data, it doesn't create views.
+ * The strings remain valid until the next update of 'afudb'.
+ * The callback is called locked and must not use 'afudb'.
+ */
+void afm_udb_applications_units(struct afm_udb *afudb, int all,
+		void (*callback)(void *closure, const char *id, const char *unit, int isuser),
+		void *closure)
+{
+	unsigned idx;
+	struct app_record *rec;
+
+	pthread_mutex_lock(&afudb->lock);
+	for (idx = 0 ; idx < afudb->applications.count ; idx++) {
+		rec = afudb->applications.all[idx];
+		if (all || rec->visible)
+			callback(closure, rec->id, rec->name, rec->isuser);
+	}
+	pthread_mutex_unlock(&afudb->lock);
 }
 
 /*
@@ -582,7 +2130,38 @@ struct json_object *afm_udb_get_application_private(struct afm_udb *afudb, const
  */
 struct json_object *afm_udb_get_application_public(struct afm_udb *afudb, const char *id, int uid)
 {
-	return get_no_case(afudb->applications.publics.byname, id, uid);
+	struct app_record *rec;
+	struct json_object *result;
+
+	pthread_mutex_lock(&afudb->lock);
+	rec = apps_search(&afudb->applications, id);
+	result = rec ? record_public(rec) : NULL;
+	pthread_mutex_unlock(&afudb->lock);
+	return result;
+}
+
+/*
+ * Get the public data of the applications of 'id' in the afm_udb object
+ * 'afudb' already serialized. The serialization is shared until the
+ * application changes.
+ * It returns a text that must be released using 'afm_udb_text_unref'.
+ * When 'generation' isn't NULL, it receives the generation of the
+ * applications searched, even when not found.
+ * Returns NULL in case of error.
+ */
+struct afm_udb_text *afm_udb_get_application_public_text(struct afm_udb *afudb, const char *id, int uid,
+			unsigned *generation)
+{
+	struct app_record *rec;
+	struct afm_udb_text *result;
+
+	pthread_mutex_lock(&afudb->lock);
+	if (generation)
+		*generation = afudb->generation;
+	rec = apps_search(&afudb->applications, id);
+	result = rec ? get_text(&rec->text, rec->text ? NULL : record_public(rec)) : NULL;
+	pthread_mutex_unlock(&afudb->lock);
+	return result;
 }
 
 
@@ -591,10 +2170,9 @@ struct json_object *afm_udb_get_application_public(struct afm_udb *afudb, const
 #include <stdio.h>
 int main()
 {
-struct afm_udb *afudb = afm_udb_create(1, 1, NULL);
-printf("publics.all = %s\n", json_object_to_json_string_ext(afudb->applications.publics.all, 3));
-printf("publics.byname = %s\n", json_object_to_json_string_ext(afudb->applications.publics.byname, 3));
-printf("privates.byname = %s\n", json_object_to_json_string_ext(afudb->applications.privates.byname, 3));
+struct afm_udb *afudb = afm_udb_create(1, 1, NULL, NULL);
+printf("publics.all = %s\n", json_object_to_json_string_ext(afm_udb_applications_public(afudb, 1, 0), 3));
+printf("privates.all = %s\n", json_object_to_json_string_ext(afm_udb_applications_private(afudb, 1, 0), 3));
 return 0;
 }
 #endif
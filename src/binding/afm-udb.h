@@ -23,14 +23,36 @@
 */
 
 struct afm_udb;
+struct afm_udb_text;
 struct json_object;
 
-extern struct afm_udb *afm_udb_create(int sys, int usr, const char *prefix);
+extern struct afm_udb *afm_udb_create(int sys, int usr, const char *prefix, const char *snapshot);
 extern void afm_udb_addref(struct afm_udb *afdb);
 extern void afm_udb_unref(struct afm_udb *afdb);
-extern int afm_udb_update(struct afm_udb *afdb);
+extern int afm_udb_update(struct afm_udb *afdb, struct json_object **changes);
+extern int afm_udb_watch(struct afm_udb *afdb);
+extern int afm_udb_watch_process(struct afm_udb *afdb, struct json_object **changes);
 extern struct json_object *afm_udb_applications_private(struct afm_udb *afdb, int all, int uid);
 extern struct json_object *afm_udb_get_application_private(struct afm_udb *afdb, const char *id, int uid);
+extern char *afm_udb_get_id_of_unit(struct afm_udb *afdb, const char *unit, int *isuser);
+extern void afm_udb_applications_units(struct afm_udb *afdb, int all,
+			void (*callback)(void *closure, const char *id, const char *unit, int isuser),
+			void *closure);
 extern struct json_object *afm_udb_applications_public(struct afm_udb *afdb, int all, int uid);
 extern struct json_object *afm_udb_get_application_public(struct afm_udb *afdb, const char *id, int uid);
+extern unsigned afm_udb_generation(struct afm_udb *afdb);
+extern struct afm_udb_text *afm_udb_applications_public_text(struct afm_udb *afdb, int all, int uid,
+			unsigned *generation);
+extern struct afm_udb_text *afm_udb_applications_projected_text(struct afm_udb *afdb, int all, int uid,
+			const char * const names[], unsigned nnames,
+			const char * const (*filters)[2], unsigned nfilters,
+			unsigned *generation);
+extern struct afm_udb_text *afm_udb_get_application_public_text(struct afm_udb *afdb, const char *id, int uid,
+			unsigned *generation);
+
+extern struct afm_udb_text *afm_udb_text_create(const char *string, size_t length);
+extern struct afm_udb_text *afm_udb_text_addref(struct afm_udb_text *text);
+extern void afm_udb_text_unref(struct afm_udb_text *text);
+extern const char *afm_udb_text_string(const struct afm_udb_text *text);
+extern size_t afm_udb_text_length(const struct afm_udb_text *text);
 
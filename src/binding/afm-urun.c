@@ -24,6 +24,7 @@
 
 #define _GNU_SOURCE
 
+#include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -32,6 +33,7 @@
 #include <stdio.h>
 #include <limits.h>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
 
 #include <json-c/json.h>
@@ -49,11 +51,50 @@
 #define WAIT_JOB_SECONDS 300
 #endif
 
+/* compute D-Bus paths of units locally instead of calling LoadUnit */
+#if !defined(AFM_URUN_LOCAL_DPATH)
+#define AFM_URUN_LOCAL_DPATH 1
+#endif
+
 static const char key_unit_d_path[] = "-unit-dpath-";
+static const char units_pattern[] = "afm-*";
+static const char units_prefix[] = "afm-";
+static const char key_required_api[] = "required-api";
+static const char key_provided_api[] = "provided-api";
+static const char units_dpath_prefix[] = "/org/freedesktop/systemd1/unit/afm_2d";
 
 /**************** get appli basis *********************/
 
-static int get_basis(struct json_object *appli, int *isuser, const char **dpath, int uid)
+/*
+ * Returns the scope of the user units of 'uid': the user bus of the
+ * daemon when 'uid' is its own uid, the pooled bus of 'uid' otherwise.
+ * The runners of the user bus of the daemon are recorded with scope 1.
+ */
+static int user_scope(int uid)
+{
+	return uid >= 0 && uid == (int)getuid() ? 1 : SYSTEMD_ISUSER_UID(uid);
+}
+
+/*
+ * Returns the D-Bus path of the unit of 'name'. When 'load' is zero and
+ * local paths are enabled, the path is computed without calling systemd.
+ * Otherwise the unit is loaded for getting its path.
+ */
+static char *unit_dpath(int isuser, const char *name, int load)
+{
+#if AFM_URUN_LOCAL_DPATH
+	if (!load)
+		return systemd_unit_dpath_of_name(name);
+#endif
+	return systemd_unit_dpath_by_name(isuser, name, 1);
+}
+
+/*
+ * Gets the scope and the D-Bus path of the unit of 'appli' for 'uid'.
+ * The path is cached in 'appli' unless 'load' is not zero, in that
+ * case the unit is loaded and the cached path is replaced.
+ */
+static int get_basis(struct json_object *appli, int *isuser, const char **dpath, int uid, int load)
 {
 	char userid[40];
 	char *dp, *arodot, *nun;
@@ -66,27 +107,31 @@ static int get_basis(struct json_object *appli, int *isuser, const char **dpath,
 		RP_ERROR("'unit-scope' missing in appli description %s", json_object_get_string(appli));
 		goto inval;
 	}
-	*isuser = strcmp(uscope, "system") != 0;
+	*isuser = strcmp(uscope, "system") ? user_scope(uid) : 0;
 
 	/* get dpaths of known users */
 	odp = NULL;
 	if (json_object_object_get_ex(appli, key_unit_d_path, &odp)) {
 		/* try not parametric dpath */
 		if (json_object_get_type(odp) == json_type_string) {
-			*dpath = json_object_get_string(odp);
-			return 0;
-		}
-		assert(json_object_get_type(odp) == json_type_object);
-		/* get userid */
-		if (uid < 0) {
-			RP_ERROR("unexpected uid %d", uid);
-			goto inval;
+			if (!load) {
+				*dpath = json_object_get_string(odp);
+				return 0;
+			}
+			odp = NULL;
+		} else {
+			assert(json_object_get_type(odp) == json_type_object);
+			/* get userid */
+			if (uid < 0) {
+				RP_ERROR("unexpected uid %d", uid);
+				goto inval;
+			}
+			rc = snprintf(userid, sizeof userid, "%d", uid);
+			assert(rc < (int)(sizeof userid));
+			/* try dpath for the user */
+			if (!load && j_read_string_at(odp, userid, dpath))
+				return 0;
 		}
-		rc = snprintf(userid, sizeof userid, "%d", uid);
-		assert(rc < (int)(sizeof userid));
-		/* try dpath for the user */
-		if (j_read_string_at(odp, userid, dpath))
-			return 0;
 	}
 
 	/* get uname */
@@ -117,7 +162,7 @@ static int get_basis(struct json_object *appli, int *isuser, const char **dpath,
 		/* get dpath of userid */
 		nun = alloca((size_t)(arodot - uname) + strlen(userid) + strlen(arodot) + 1);
 		stpcpy(stpcpy(stpncpy(nun, uname, (size_t)(arodot - uname)), userid), arodot);
-		dp = systemd_unit_dpath_by_name(*isuser, nun, 1);
+		dp = unit_dpath(*isuser, nun, load);
 		if (dp == NULL) {
 			RP_ERROR("Can't load unit of name %s for %s: %m", nun, uscope);
 			goto error;
@@ -131,7 +176,7 @@ static int get_basis(struct json_object *appli, int *isuser, const char **dpath,
 		j_read_string_at(odp, userid, dpath);
 	} else {
 		/* get dpath */
-		dp = systemd_unit_dpath_by_name(*isuser, uname, 1);
+		dp = unit_dpath(*isuser, uname, load);
 		if (dp == NULL) {
 			RP_ERROR("Can't load unit of name %s for %s: %m", uname, uscope);
 			goto error;
@@ -159,35 +204,7 @@ error:
 
 static enum SysD_State wait_state_stable(int isuser, const char *dpath, char *job)
 {
-	int trial;
-	enum SysD_State state = SysD_State_INVALID;
-	struct timespec tispec;
-	const int period_ms = 10;
-	const int trial_s = WAIT_JOB_SECONDS;
-	const int trial_count = (trial_s * 1000) / period_ms;
-	const int period_ns = period_ms * 1000000;
-
-	for (trial = 1 ; trial <= trial_count ; trial++) {
-		if (job) {
-			if (!systemd_job_is_pending(isuser, job))
-				job = NULL;
-		}
-		if (!job) {
-			state = systemd_unit_state_of_dpath(isuser, dpath);
-			switch (state) {
-			case SysD_State_Active:
-			case SysD_State_Failed:
-			case SysD_State_Inactive:
-				return state;
-			default:
-				break;
-			}
-		}
-		tispec.tv_sec = 0;
-		tispec.tv_nsec = period_ns;
-		nanosleep(&tispec, NULL);
-	}
-	return state;
+	return systemd_unit_wait_stable(isuser, dpath, job, WAIT_JOB_SECONDS * 1000);
 }
 
 /*
@@ -196,10 +213,11 @@ static enum SysD_State wait_state_stable(int isuser, const char *dpath, char *jo
  *  - 'runid', its runid
  *  - 'pid', its pid
  *  - 'state', its systemd state
+ *  - 'frozen', is it frozen?
  *
  * Returns the created object or NULL in case of error.
  */
-static json_object *mkstate(const char *id, int runid, int pid, enum SysD_State state)
+static json_object *mkstate(const char *id, int runid, int pid, enum SysD_State state, int frozen)
 {
 	struct json_object *result, *pids;
 
@@ -222,7 +240,7 @@ static json_object *mkstate(const char *id, int runid, int pid, enum SysD_State
 	}
 
 	/* the state */
-	if (!j_add_string(result, "state", state == SysD_State_Active ? "running" : "terminated"))
+	if (!j_add_string(result, "state", state != SysD_State_Active ? "terminated" : frozen ? "frozen" : "running"))
 		goto error;
 
 	/* the application id */
@@ -238,6 +256,431 @@ error:
 	return NULL;
 }
 
+/**************** table of runners *********************/
+
+#if !defined(AFM_URUN_RUNNERS_BUCKETS)
+#define AFM_URUN_RUNNERS_BUCKETS 64
+#endif
+
+/*
+ * The runners of applications started or seen by afm-urun are recorded
+ * with their runid and the D-Bus path of their unit. The records are
+ * removed when systemd signals that the unit isn't active anymore,
+ * so the table is only used for scopes whose units can be watched.
+ */
+struct runner {
+	struct runner *next_runid;	/* next in the bucket of runids */
+	struct runner *next_dpath;	/* next in the bucket of dpaths */
+	int runid;			/* the runid (main pid of the unit) */
+	int isuser;			/* scope of the unit */
+	int frozen;			/* is the unit frozen? */
+	char *id;			/* id of the application */
+	char dpath[];			/* D-Bus path of the unit */
+};
+
+static struct runner *runners_by_runid[AFM_URUN_RUNNERS_BUCKETS];
+static struct runner *runners_by_dpath[AFM_URUN_RUNNERS_BUCKETS];
+static int runners_watched[2]; /* 0: not tried, 1: watched, -1: can't watch */
+
+static unsigned hash_runid(int runid)
+{
+	return (unsigned)runid % AFM_URUN_RUNNERS_BUCKETS;
+}
+
+static unsigned hash_dpath(const char *dpath)
+{
+	unsigned h = 0;
+
+	while (*dpath)
+		h = h * 31 + (unsigned char)*dpath++;
+	return h % AFM_URUN_RUNNERS_BUCKETS;
+}
+
+static struct runner *runner_of_runid(int runid)
+{
+	struct runner *runner = runners_by_runid[hash_runid(runid)];
+
+	while (runner && runner->runid != runid)
+		runner = runner->next_runid;
+	return runner;
+}
+
+static struct runner *runner_of_dpath(int isuser, const char *dpath)
+{
+	struct runner *runner = runners_by_dpath[hash_dpath(dpath)];
+
+	while (runner && (runner->isuser != isuser || strcmp(runner->dpath, dpath)))
+		runner = runner->next_dpath;
+	return runner;
+}
+
+static void runner_remove(struct runner *runner)
+{
+	struct runner **prv;
+
+	prv = &runners_by_runid[hash_runid(runner->runid)];
+	while (*prv != runner)
+		prv = &(*prv)->next_runid;
+	*prv = runner->next_runid;
+
+	prv = &runners_by_dpath[hash_dpath(runner->dpath)];
+	while (*prv != runner)
+		prv = &(*prv)->next_dpath;
+	*prv = runner->next_dpath;
+
+	free(runner->id);
+	free(runner);
+}
+
+static struct runner *runner_add(int runid, int isuser, const char *dpath, const char *id);
+
+/* the listener of the lifecycle of applications */
+static struct afm_udb *listen_db;
+static void (*listen_cb)(void *closure, enum SysD_State state, struct json_object *desc);
+static void *listen_closure;
+
+/*
+ * Sends to the listener the lifecycle event of the runner 'runid'
+ * of the application 'id'
+ */
+static void notify(const char *id, int runid, enum SysD_State state)
+{
+	struct json_object *desc;
+
+	desc = mkstate(id, runid, runid, state, 0);
+	if (desc == NULL)
+		RP_ERROR("can't notify %s of %s", state == SysD_State_Active ? "start" : "stop", id);
+	else {
+		listen_cb(listen_closure, state, desc);
+		json_object_put(desc);
+	}
+}
+
+/*
+ * Get the id of the application of the unit of 'dpath' in 'db'
+ * if its scope is the one of 'isuser'. When 'instance' isn't NULL,
+ * it receives the uid of instances of templates or -1.
+ * Returns the id to be freed or NULL if not found.
+ */
+static char *id_of_dpath(struct afm_udb *db, int isuser, const char *dpath, int *instance)
+{
+	int scope;
+	long inst;
+	char *name, *arobase, *dot, *end, *id;
+
+	/* get the name of the unit */
+	name = systemd_unit_name_of_dpath(dpath);
+	if (name == NULL)
+		return NULL;
+
+	/* instances of users, like afm-appli-xxx@1000.service, are of template afm-appli-xxx@.service */
+	inst = -1;
+	arobase = strchr(name, '@');
+	if (arobase) {
+		dot = strchr(arobase, '.');
+		if (dot) {
+			inst = strtol(arobase + 1, &end, 10);
+			if (end == dot && end != arobase + 1)
+				memmove(arobase + 1, dot, strlen(dot) + 1);
+			else
+				inst = -1;
+		}
+	}
+	if (instance)
+		*instance = inst < 0 || inst > INT_MAX ? -1 : (int)inst;
+
+	/* search the application */
+	id = afm_udb_get_id_of_unit(db, name, &scope);
+	free(name);
+	if (id != NULL && !scope != !isuser) {
+		free(id);
+		id = NULL;
+	}
+	return id;
+}
+
+/*
+ * Records a started unit whose pid is being read
+ */
+struct unit_started {
+	int isuser;		/* scope of the unit */
+	char *id;		/* id of the application */
+	char dpath[];		/* D-Bus path of the unit */
+};
+
+/*
+ * Receives the pid of the started unit: records and notifies its runner
+ * unless recorded meanwhile
+ */
+static void on_unit_started_pid(void *closure, const int pids[])
+{
+	struct unit_started *us = closure;
+
+	if (pids[0] > 0
+	 && runner_of_dpath(us->isuser, us->dpath) == NULL
+	 && runner_add(pids[0], us->isuser, us->dpath, us->id))
+		notify(us->id, pids[0], SysD_State_Active);
+	free(us->id);
+	free(us);
+}
+
+/*
+ * Reads asynchronously the pid of the started unit of 'dpath'
+ * for recording and notifying its runner
+ */
+static void on_unit_started(int isuser, const char *dpath)
+{
+	char *id;
+	const char *dpaths[1];
+	struct unit_started *us;
+
+	id = id_of_dpath(listen_db, isuser, dpath, NULL);
+	if (id != NULL) {
+		us = malloc(sizeof *us + strlen(dpath) + 1);
+		if (us == NULL)
+			free(id);
+		else {
+			us->isuser = isuser;
+			us->id = id;
+			strcpy(us->dpath, dpath);
+			dpaths[0] = us->dpath;
+			if (systemd_units_pid_of_dpaths_async(isuser, 1, dpaths, on_unit_started_pid, us) < 0) {
+				free(id);
+				free(us);
+			}
+		}
+	}
+}
+
+/*
+ * Receives the changes of state of units from systemd
+ */
+static void on_unit_state(void *closure, int isuser, const char *dpath, enum SysD_State state)
+{
+	int runid;
+	char *id;
+	struct runner *runner;
+
+	runner = runner_of_dpath(isuser, dpath);
+	if (state != SysD_State_Active && state != SysD_State_Reloading) {
+		if (runner) {
+			runid = runner->runid;
+			id = runner->id;
+			runner->id = NULL;
+			runner_remove(runner);
+			if (listen_cb)
+				notify(id, runid, state == SysD_State_Failed ? state : SysD_State_Inactive);
+			free(id);
+		}
+	}
+	else if (state == SysD_State_Active && !runner && listen_cb)
+		on_unit_started(isuser, dpath);
+}
+
+/*
+ * Is the table of runners usable for the scope 'isuser'?
+ * Runners of the pooled buses of users are not recorded.
+ */
+static int runners_enabled(int isuser)
+{
+	int *watched = &runners_watched[!!isuser];
+
+	if (isuser > 1)
+		return 0;
+
+	if (*watched == 0) {
+		*watched = systemd_watch_units(isuser, units_prefix, on_unit_state, NULL) < 0 ? -1 : 1;
+		if (*watched < 0)
+			RP_NOTICE("can't watch %s units, runners are not recorded: %m", isuser ? "user" : "system");
+	}
+	return *watched > 0;
+}
+
+/*
+ * Records the runner 'runid' of the application 'id'
+ * whose unit is of 'dpath' in the scope 'isuser'.
+ * Returns the record or NULL when not recorded.
+ */
+static struct runner *runner_add(int runid, int isuser, const char *dpath, const char *id)
+{
+	struct runner *runner;
+	unsigned hr, hd;
+
+	if (!runners_enabled(isuser))
+		return NULL;
+
+	/* already recorded? */
+	runner = runner_of_dpath(isuser, dpath);
+	if (runner) {
+		if (runner->runid == runid)
+			return runner;
+		runner_remove(runner);
+	}
+	runner = runner_of_runid(runid);
+	if (runner)
+		runner_remove(runner);
+
+	/* record it */
+	runner = malloc(sizeof *runner + strlen(dpath) + 1);
+	if (runner == NULL)
+		return NULL;
+	runner->id = strdup(id);
+	if (runner->id == NULL) {
+		free(runner);
+		return NULL;
+	}
+	runner->runid = runid;
+	runner->isuser = isuser;
+	runner->frozen = 0;
+	strcpy(runner->dpath, dpath);
+	hr = hash_runid(runid);
+	runner->next_runid = runners_by_runid[hr];
+	runners_by_runid[hr] = runner;
+	hd = hash_dpath(dpath);
+	runner->next_dpath = runners_by_dpath[hd];
+	runners_by_dpath[hd] = runner;
+	return runner;
+}
+
+/*
+ * Drops the list of the runners recorded at start of listening
+ */
+static void drop_list(void *closure, struct json_object *list)
+{
+	json_object_put(list);
+}
+
+/*
+ * Listens the lifecycle of the applications of 'db'. The 'callback'
+ * receives the state Active when an application starts, Inactive
+ * when it stops and Failed when it fails, with the description
+ * of its runner as given by afm_urun_state.
+ * Only runners of the watched scopes are notified.
+ * Returns 0 on success or -1 with errno set when no scope is watched.
+ */
+int afm_urun_listen(struct afm_udb *db,
+		void (*callback)(void *closure, enum SysD_State state, struct json_object *desc),
+		void *closure)
+{
+	int sys, usr;
+
+	listen_db = db;
+	listen_cb = callback;
+	listen_closure = closure;
+
+	sys = runners_enabled(0);
+	usr = runners_enabled(1);
+	if (!sys && !usr) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	/* record the runners already running */
+	afm_urun_list_async(db, 1, -1, drop_list, NULL);
+	return 0;
+}
+
+/**************** statistics of starts *********************/
+
+#if !defined(AFM_URUN_STATS_SAMPLES)
+#define AFM_URUN_STATS_SAMPLES 64
+#endif
+
+/*
+ * The phases of a start
+ */
+enum phase {
+	Phase_Basis,	/* getting the scope and the path of the unit */
+	Phase_Start,	/* queuing the start job */
+	Phase_Wait,	/* waiting the end of the job */
+	Phase_Pid,	/* reading the pid */
+	Phase_Count
+};
+
+static const char *phase_names[Phase_Count] = {
+	"basis",
+	"start",
+	"wait",
+	"pid"
+};
+
+/*
+ * Records the durations of the phases of the last starts of an application
+ */
+struct app_stats {
+	struct app_stats *next;		/* next statistics */
+	unsigned count;			/* count of recorded starts */
+	uint32_t samples[Phase_Count][AFM_URUN_STATS_SAMPLES]; /* rolling durations in microseconds */
+	char id[];			/* id of the application */
+};
+
+static struct app_stats *all_stats;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Records for the application 'appli' the durations of the phases
+ * given by the timestamps 'times' of their begins and end
+ */
+static void stats_record(struct json_object *appli, const uint64_t times[Phase_Count + 1])
+{
+	struct app_stats *stats;
+	const char *id;
+	unsigned idx, phase;
+	uint64_t d;
+
+	if (!j_read_string_at(appli, "id", &id))
+		return;
+
+	/* search or create the statistics */
+	for (stats = all_stats ; stats && strcmp(stats->id, id) ; stats = stats->next);
+	if (stats == NULL) {
+		stats = calloc(1, sizeof *stats + strlen(id) + 1);
+		if (stats == NULL)
+			return;
+		strcpy(stats->id, id);
+		stats->next = all_stats;
+		all_stats = stats;
+	}
+
+	/* record the durations */
+	idx = stats->count++ % AFM_URUN_STATS_SAMPLES;
+	for (phase = 0 ; phase < Phase_Count ; phase++) {
+		d = times[phase + 1] - times[phase];
+		stats->samples[phase][idx] = d > UINT32_MAX ? UINT32_MAX : (uint32_t)d;
+	}
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Returns the object describing percentiles of the 'count' 'samples'
+ */
+static struct json_object *stats_phase(const uint32_t *samples, unsigned count)
+{
+	uint32_t sorted[AFM_URUN_STATS_SAMPLES];
+	struct json_object *result = NULL;
+
+	memcpy(sorted, samples, count * sizeof *sorted);
+	qsort(sorted, count, sizeof *sorted, cmp_u32);
+	rp_jsonc_pack(&result, "{sI sI sI sI}",
+		"p50", (int64_t)sorted[(50 * count + 99) / 100 - 1],
+		"p95", (int64_t)sorted[(95 * count + 99) / 100 - 1],
+		"p99", (int64_t)sorted[(99 * count + 99) / 100 - 1],
+		"max", (int64_t)sorted[count - 1]);
+	return result;
+}
+
 /**************** API handling ************************/
 
 /*
@@ -256,6 +699,45 @@ int afm_urun_start(struct json_object *appli, int uid)
 	return afm_urun_once(appli, uid);
 }
 
+/*
+ * Ends the start of the application 'appli' of 'uid' whose unit
+ * of 'udpath' reached the 'state'.
+ *
+ * Returns the runid in case of success or -1 in case of error
+ */
+static int started(struct json_object *appli, int uid, int isuser, const char *udpath, enum SysD_State state)
+{
+	const char *uscope, *uname, *id;
+	int rc;
+
+	switch (state) {
+	case SysD_State_Active:
+	case SysD_State_Inactive:
+		break;
+	case SysD_State_Failed:
+		j_read_string_at(appli, "unit-scope", &uscope);
+		j_read_string_at(appli, "unit-name", &uname);
+		RP_ERROR("start error %s unit %s for uid %d: %s", uscope, uname, uid,
+							systemd_name_of_state(state));
+		return -1;
+	default:
+		j_read_string_at(appli, "unit-scope", &uscope);
+		j_read_string_at(appli, "unit-name", &uname);
+		RP_ERROR("can't wait %s unit %s for uid %d: %m", uscope, uname, uid);
+		return -1;
+	}
+
+	rc = systemd_unit_pid_of_dpath(isuser, udpath);
+	if (rc < 0) {
+		j_read_string_at(appli, "unit-scope", &uscope);
+		j_read_string_at(appli, "unit-name", &uname);
+		RP_ERROR("can't get pid of %s unit %s for uid %d: %m", uscope, uname, uid);
+	}
+	else if (rc > 0 && j_read_string_at(appli, "id", &id))
+		runner_add(rc, isuser, udpath, id);
+	return rc;
+}
+
 /*
  * Returns the runid of a previously started application 'appli'
  * or if none is running, starts the application described by 'appli'
@@ -273,62 +755,345 @@ int afm_urun_once(struct json_object *appli, int uid)
 	enum SysD_State state;
 	int rc, isuser;
 	char *job;
-
-	job = NULL;
+	uint64_t times[Phase_Count + 1];
 
 	/* retrieve basis */
-	rc = get_basis(appli, &isuser, &udpath, uid);
+	times[Phase_Basis] = now_usec();
+	rc = get_basis(appli, &isuser, &udpath, uid, 0);
 	if (rc < 0)
-		goto error;
+		return -1;
 
 	/* start the unit */
+	times[Phase_Start] = now_usec();
 	rc = systemd_unit_start_dpath(isuser, udpath, &job);
+#if AFM_URUN_LOCAL_DPATH
+	/* on failure, retry with the path given by LoadUnit */
+	if (rc < 0 && get_basis(appli, &isuser, &udpath, uid, 1) >= 0)
+		rc = systemd_unit_start_dpath(isuser, udpath, &job);
+#endif
 	if (rc < 0) {
 		j_read_string_at(appli, "unit-scope", &uscope);
 		j_read_string_at(appli, "unit-name", &uname);
 		RP_ERROR("can't start %s unit %s for uid %d", uscope, uname, uid);
-		goto error;
+		return -1;
 	}
 
+	times[Phase_Wait] = now_usec();
 	state = wait_state_stable(isuser, udpath, job);
-	switch (state) {
-	case SysD_State_Active:
-	case SysD_State_Inactive:
-		break;
-	case SysD_State_Failed:
-		j_read_string_at(appli, "unit-scope", &uscope);
-		j_read_string_at(appli, "unit-name", &uname);
-		RP_ERROR("start error %s unit %s for uid %d: %s", uscope, uname, uid,
-							systemd_name_of_state(state));
-		goto error;
-	default:
-		j_read_string_at(appli, "unit-scope", &uscope);
-		j_read_string_at(appli, "unit-name", &uname);
-		RP_ERROR("can't wait %s unit %s for uid %d: %m", uscope, uname, uid);
-		goto error;
+	free(job);
+	times[Phase_Pid] = now_usec();
+	rc = started(appli, uid, isuser, udpath, state);
+	times[Phase_Count] = now_usec();
+	if (rc > 0)
+		stats_record(appli, times);
+	return rc;
+}
+
+/*
+ * Records an asynchronous start
+ */
+struct once_async {
+	struct json_object *appli;
+	int uid;
+	int isuser;
+	char *udpath;
+	uint64_t times[Phase_Count + 1];
+	void (*callback)(void *closure, int runid);
+	void *closure;
+};
+
+/*
+ * Called when the unit of an asynchronous start is stable
+ */
+static void once_async_done(void *closure, enum SysD_State state)
+{
+	struct once_async *oa = closure;
+	int runid;
+
+	oa->times[Phase_Pid] = now_usec();
+	runid = started(oa->appli, oa->uid, oa->isuser, oa->udpath, state);
+	oa->times[Phase_Count] = now_usec();
+	if (runid > 0)
+		stats_record(oa->appli, oa->times);
+	oa->callback(oa->closure, runid);
+	json_object_put(oa->appli);
+	free(oa->udpath);
+	free(oa);
+}
+
+/*
+ * Same as afm_urun_once but doesn't block: the unit is started and
+ * waited using the event loop of the bus and the result (the runid or -1)
+ * is given to 'callback' with 'closure'. When the bus has no event
+ * loop, the start is synchronous and 'callback' is called before returning.
+ *
+ * Returns 0 if 'callback' is or will be called or -1 in case of error,
+ * 'callback' is then not called.
+ */
+int afm_urun_once_async(struct json_object *appli, int uid,
+			void (*callback)(void *closure, int runid), void *closure)
+{
+	const char *udpath, *uscope, *uname;
+	struct once_async *oa;
+	int rc, isuser;
+	uint64_t begin;
+
+	/* retrieve basis */
+	begin = now_usec();
+	rc = get_basis(appli, &isuser, &udpath, uid, 0);
+	if (rc < 0)
+		return -1;
+
+	/* record the start */
+	oa = malloc(sizeof *oa);
+	if (oa == NULL)
+		return -1;
+	oa->times[Phase_Basis] = begin;
+	oa->times[Phase_Start] = now_usec();
+	oa->udpath = strdup(udpath);
+	if (oa->udpath == NULL) {
+		free(oa);
+		return -1;
 	}
+	oa->appli = json_object_get(appli);
+	oa->uid = uid;
+	oa->isuser = isuser;
+	oa->callback = callback;
+	oa->closure = closure;
 
-	rc = systemd_unit_pid_of_dpath(isuser, udpath);
+	/* start the unit */
+	rc = systemd_unit_start_wait_async(isuser, udpath, WAIT_JOB_SECONDS * 1000,
+						&oa->times[Phase_Wait], once_async_done, oa);
 	if (rc < 0) {
+		json_object_put(oa->appli);
+		free(oa->udpath);
+		free(oa);
+		if (errno == ENOTSUP) {
+			/* no event loop, fallback to synchronous start */
+			callback(closure, afm_urun_once(appli, uid));
+			return 0;
+		}
 		j_read_string_at(appli, "unit-scope", &uscope);
 		j_read_string_at(appli, "unit-name", &uname);
-		RP_ERROR("can't get pid of %s unit %s for uid %d: %m", uscope, uname, uid);
-		goto error;
+		RP_ERROR("can't start %s unit %s for uid %d", uscope, uname, uid);
+		return -1;
 	}
+	return 0;
+}
 
-	free(job);
-	return rc;
+/*
+ * Gets the 'idx'th value of the field 'key' of 'appli', a field that is
+ * a string or an array of strings. Returns NULL after the last value.
+ */
+static const char *field_value(struct json_object *appli, const char *key, unsigned idx)
+{
+	struct json_object *obj;
 
-error:
-	free(job);
-	return -1;
+	if (!json_object_object_get_ex(appli, key, &obj))
+		return NULL;
+	if (json_object_is_type(obj, json_type_array)) {
+		if (idx >= json_object_array_length(obj))
+			return NULL;
+		obj = json_object_array_get_idx(obj, idx);
+	}
+	else if (idx)
+		return NULL;
+	return json_object_get_string(obj);
 }
 
-static int not_yet_implemented(const char *what)
+/*
+ * Does the application 'requirer' require an api provided by 'provider'?
+ */
+static int requires_from(struct json_object *requirer, struct json_object *provider)
 {
-	RP_ERROR("%s isn't yet implemented", what);
-	errno = ENOTSUP;
-	return -1;
+	unsigned ir, ip;
+	const char *r, *p;
+
+	for (ir = 0 ; (r = field_value(requirer, key_required_api, ir)) != NULL ; ir++)
+		for (ip = 0 ; (p = field_value(provider, key_provided_api, ip)) != NULL ; ip++)
+			if (!strcmp(r, p))
+				return 1;
+	return 0;
+}
+
+/*
+ * Records a group of asynchronous starts
+ */
+struct start_many {
+	unsigned count;			/* count of applications */
+	unsigned wave;			/* the wave being started */
+	unsigned lastwave;		/* the last wave to start */
+	unsigned remaining;		/* count of pending starts and 1 while launching */
+	int uid;			/* the user */
+	int *runids;			/* the runids of the started applications */
+	void (*callback)(void *closure, const int runids[]);
+	void *closure;			/* closure of the callback */
+	struct start_one {
+		struct start_many *group;	/* the group */
+		struct json_object *appli;	/* the application or NULL */
+		unsigned index;			/* index of the application */
+		unsigned wave;			/* wave of the start */
+	} items[];
+};
+
+/*
+ * Computes the waves of the starts: the applications providing apis
+ * required by an other application are started in an earlier wave.
+ * It uses Kahn's algorithm: an application enters the wave following
+ * the one of its last provider. The applications remaining in cycles
+ * are started together in a final wave. No wave is empty.
+ */
+static void start_many_waves(struct start_many *sm)
+{
+	unsigned i, j, n, head, tail, wave, *indeg, *queue;
+	unsigned char *deps;
+
+	n = sm->count;
+	sm->lastwave = 0;
+	indeg = n > 1 ? malloc(2 * n * sizeof *indeg + n * n) : NULL;
+	if (indeg == NULL)
+		return;
+	queue = &indeg[n];
+	deps = (unsigned char*)&queue[n];
+
+	/* compute the dependencies and the count of providers */
+	for (i = 0 ; i < n ; i++) {
+		indeg[i] = 0;
+		for (j = 0 ; j < n ; j++) {
+			deps[i * n + j] = i != j && sm->items[i].appli && sm->items[j].appli
+					&& requires_from(sm->items[i].appli, sm->items[j].appli);
+			indeg[i] += deps[i * n + j];
+		}
+	}
+
+	/* the first wave is made of the applications without provider */
+	tail = 0;
+	for (i = 0 ; i < n ; i++)
+		if (sm->items[i].appli != NULL && indeg[i] == 0)
+			queue[tail++] = i;
+
+	/* the providers are dequeued in the order of their waves */
+	for (head = 0 ; head < tail ; head++) {
+		j = queue[head];
+		for (i = 0 ; i < n ; i++)
+			if (deps[i * n + j] && --indeg[i] == 0) {
+				sm->items[i].wave = sm->items[j].wave + 1;
+				queue[tail++] = i;
+			}
+	}
+
+	/* the applications of cycles are in the final wave */
+	wave = tail ? sm->items[queue[tail - 1]].wave : 0;
+	sm->lastwave = wave;
+	for (i = 0 ; i < n ; i++)
+		if (sm->items[i].appli != NULL && indeg[i] != 0)
+			sm->items[i].wave = sm->lastwave = wave + (tail != 0);
+	free(indeg);
+}
+
+/*
+ * Terminates the group: calls the callback and releases the memory
+ */
+static void start_many_end(struct start_many *sm)
+{
+	unsigned idx;
+
+	sm->callback(sm->closure, sm->runids);
+	for (idx = 0 ; idx < sm->count ; idx++)
+		json_object_put(sm->items[idx].appli);
+	free(sm->runids);
+	free(sm);
+}
+
+static void start_many_launch(struct start_many *sm);
+
+static void start_many_started(void *closure, int runid)
+{
+	struct start_one *so = closure;
+	struct start_many *sm = so->group;
+
+	sm->runids[so->index] = runid;
+	if (--sm->remaining == 0) {
+		if (sm->wave < sm->lastwave) {
+			sm->wave++;
+			start_many_launch(sm);
+		}
+		else
+			start_many_end(sm);
+	}
+}
+
+/*
+ * Starts together the applications of the current wave. When all the
+ * starts of the wave are already done, the next wave is launched by
+ * the loop, not by recursion.
+ */
+static void start_many_launch(struct start_many *sm)
+{
+	unsigned idx;
+
+	for (;;) {
+		sm->remaining = 1;
+		for (idx = 0 ; idx < sm->count ; idx++) {
+			if (sm->items[idx].appli != NULL && sm->items[idx].wave == sm->wave) {
+				sm->remaining++;
+				if (afm_urun_once_async(sm->items[idx].appli, sm->uid, start_many_started, &sm->items[idx]) < 0)
+					sm->remaining--;
+			}
+		}
+		if (--sm->remaining != 0)
+			return;
+		if (sm->wave >= sm->lastwave)
+			break;
+		sm->wave++;
+	}
+	start_many_end(sm);
+}
+
+/*
+ * Starts the 'count' applications of 'applis' for 'uid' together:
+ * all the starts are sent before waiting the end of any of them.
+ * Applications requiring an api provided by other applications of
+ * 'applis' are started in a later wave, when the providers are started.
+ * When all are done, 'callback' receives 'closure' and the array of the
+ * runids of the applications, -1 for the ones that couldn't start
+ * or whose 'applis' entry is NULL.
+ *
+ * Returns 0 if 'callback' is or will be called or -1 in case of error,
+ * 'callback' is then not called.
+ */
+int afm_urun_start_many(unsigned count, struct json_object *applis[], int uid,
+			void (*callback)(void *closure, const int runids[]), void *closure)
+{
+	struct start_many *sm;
+	unsigned idx;
+
+	/* allocates the group */
+	sm = malloc(sizeof *sm + count * sizeof *sm->items);
+	if (sm == NULL)
+		return -1;
+	sm->runids = malloc((count ? count : 1) * sizeof *sm->runids);
+	if (sm->runids == NULL) {
+		free(sm);
+		return -1;
+	}
+	sm->count = count;
+	sm->wave = 0;
+	sm->uid = uid;
+	sm->callback = callback;
+	sm->closure = closure;
+	for (idx = 0 ; idx < count ; idx++) {
+		sm->runids[idx] = -1;
+		sm->items[idx].group = sm;
+		sm->items[idx].appli = json_object_get(applis[idx]);
+		sm->items[idx].index = idx;
+		sm->items[idx].wave = 0;
+	}
+
+	/* starts the applications by waves */
+	start_many_waves(sm);
+	start_many_launch(sm);
+	return 0;
 }
 
 /*
@@ -338,76 +1103,431 @@ static int not_yet_implemented(const char *what)
  */
 int afm_urun_terminate(int runid, int uid)
 {
-	int rc = systemd_unit_stop_pid(1 /* TODO: isuser? */, (unsigned)runid, NULL);
-	if (rc < 0)
-		rc = systemd_unit_stop_pid(0 /* TODO: isuser? */, (unsigned)runid, NULL);
+	int rc;
+	struct runner *runner;
+
+	runner = runner_of_runid(runid);
+	if (runner)
+		rc = systemd_unit_stop_dpath(runner->isuser, runner->dpath, NULL);
+	else {
+		rc = systemd_unit_stop_pid(user_scope(uid), (unsigned)runid, NULL);
+		if (rc < 0)
+			rc = systemd_unit_stop_pid(0, (unsigned)runid, NULL);
+	}
 	return rc < 0 ? rc : 0;
 }
 
 /*
- * Stops (aka pause) the runner of 'runid'
+ * Gets in 'isuser' and 'dpath' the scope and the D-Bus path of the unit
+ * of the runner 'runid' of 'uid'. Only units of applications are searched.
  *
  * Returns 0 in case of success or -1 in case of error
  */
-int afm_urun_pause(int runid, int uid)
+static int unit_of_runid(int runid, int uid, int *isuser, char **dpath)
 {
-	return not_yet_implemented("pause");
+	struct runner *runner;
+
+	runner = runner_of_runid(runid);
+	if (runner) {
+		*isuser = runner->isuser;
+		*dpath = strdup(runner->dpath);
+		if (*dpath == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		return 0;
+	}
+	*dpath = systemd_unit_dpath_by_pid(*isuser = user_scope(uid), (unsigned)runid);
+	if (!*dpath)
+		*dpath = systemd_unit_dpath_by_pid(*isuser = 0, (unsigned)runid);
+	if (!*dpath) {
+		errno = ESRCH;
+		return -1;
+	}
+	if (strncmp(*dpath, units_dpath_prefix, sizeof units_dpath_prefix - 1)) {
+		free(*dpath);
+		errno = EPERM;
+		return -1;
+	}
+	return 0;
 }
 
 /*
- * Continue (aka resume) the runner of 'runid'
+ * Is the unit of 'dpath' in the scope 'isuser' the unit of an
+ * application of 'db' for 'uid', as computed by get_basis?
+ * Returns 1 if yes or 0 if not.
+ */
+static int is_unit_of_uid(struct afm_udb *db, int isuser, const char *dpath, int uid)
+{
+	int scope, result;
+	char *id;
+	const char *udpath;
+	struct json_object *appli;
+
+	result = 0;
+	id = id_of_dpath(db, isuser, dpath, NULL);
+	if (id != NULL) {
+		appli = afm_udb_get_application_private(db, id, uid);
+		result = appli != NULL
+			&& get_basis(appli, &scope, &udpath, uid, 0) >= 0
+			&& scope == isuser
+			&& !strcmp(udpath, dpath);
+		json_object_put(appli);
+		free(id);
+	}
+	return result;
+}
+
+/*
+ * Freezes or thaws, according to 'freeze', the unit of the runner 'runid'
+ * if it is the unit of an application of 'db' for 'uid'.
  *
  * Returns 0 in case of success or -1 in case of error
  */
-int afm_urun_resume(int runid, int uid)
+static int freeze_runid(struct afm_udb *db, int runid, int uid, int freeze)
 {
-	return not_yet_implemented("resume");
+	int rc, isuser;
+	char *dpath;
+	struct runner *runner;
+
+	rc = unit_of_runid(runid, uid, &isuser, &dpath);
+	if (rc >= 0 && !is_unit_of_uid(db, isuser, dpath, uid)) {
+		free(dpath);
+		errno = EPERM;
+		rc = -1;
+	}
+	if (rc >= 0) {
+		rc = freeze ? systemd_unit_freeze_dpath(isuser, dpath) : systemd_unit_thaw_dpath(isuser, dpath);
+		if (rc >= 0) {
+			runner = runner_of_dpath(isuser, dpath);
+			if (runner)
+				runner->frozen = freeze;
+		}
+		free(dpath);
+	}
+	if (rc < 0)
+		RP_ERROR("can't %s runid %d: %m", freeze ? "freeze" : "thaw", runid);
+	return rc;
 }
 
 /*
- * Get the list of the runners.
+ * Stops (aka pause) the runner of 'runid' by freezing its unit
  *
- * Returns the list or NULL in case of error.
+ * Returns 0 in case of success or -1 in case of error
  */
-struct json_object *afm_urun_list(struct afm_udb *db, int all, int uid)
+int afm_urun_pause(struct afm_udb *db, int runid, int uid)
 {
-	rp_jsonc_index_t i, n;
-	int isuser, pid;
-	const char *udpath;
-	const char *id;
-	enum SysD_State state;
+	return freeze_runid(db, runid, uid, 1);
+}
+
+/*
+ * Continue (aka resume) the runner of 'runid' by thawing its unit
+ *
+ * Returns 0 in case of success or -1 in case of error
+ */
+int afm_urun_resume(struct afm_udb *db, int runid, int uid)
+{
+	return freeze_runid(db, runid, uid, 0);
+}
+
+/*
+ * Records the active units of a scope
+ */
+struct active_unit {
+	char *name;
+	char *dpath;
+};
+
+struct actives {
+	unsigned count;
+	unsigned size;
+	struct active_unit *units;
+};
+
+/*
+ * Callback of the listing of units recording the active ones
+ */
+static void add_active(void *closure, struct SysD_ListUnitItem *lui)
+{
+	struct actives *actives = closure;
+	struct active_unit *units;
+	char *name, *dpath;
+	unsigned size;
+
+	if (systemd_state_of_name(lui->active_state) != SysD_State_Active)
+		return;
+
+	/* ensure space */
+	if (actives->count == actives->size) {
+		size = actives->size ? actives->size << 1 : 16;
+		units = realloc(actives->units, size * sizeof *units);
+		if (units == NULL)
+			return;
+		actives->units = units;
+		actives->size = size;
+	}
+
+	/* record the unit */
+	name = strdup(lui->name);
+	dpath = strdup(lui->opath);
+	if (name == NULL || dpath == NULL) {
+		free(name);
+		free(dpath);
+		return;
+	}
+	actives->units[actives->count].name = name;
+	actives->units[actives->count].dpath = dpath;
+	actives->count++;
+}
+
+static int cmp_active(const void *a, const void *b)
+{
+	return strcmp(((const struct active_unit*)a)->name, ((const struct active_unit*)b)->name);
+}
+
+/*
+ * Lists the active units of the framework for the scope 'isuser'
+ */
+static void list_actives(struct actives *actives, int isuser)
+{
+	if (systemd_list_unit_pattern(isuser, units_pattern, add_active, actives) < 0)
+		RP_WARNING("can't list %s units: %m", isuser ? "user" : "system");
+	if (actives->count > 1)
+		qsort(actives->units, actives->count, sizeof *actives->units, cmp_active);
+}
+
+/*
+ * Returns the dpath of the active unit of 'name' or NULL if not active
+ */
+static const char *search_active(struct actives *actives, const char *name)
+{
+	struct active_unit key, *found;
+
+	key.name = (char*)name;
+	found = actives->count == 0 ? NULL
+		: bsearch(&key, actives->units, actives->count, sizeof *actives->units, cmp_active);
+	return found ? found->dpath : NULL;
+}
+
+static void free_actives(struct actives *actives)
+{
+	unsigned i;
+
+	for (i = 0 ; i < actives->count ; i++) {
+		free(actives->units[i].name);
+		free(actives->units[i].dpath);
+	}
+	free(actives->units);
+}
+
+/*
+ * Computes in 'buffer' of 'size' the name of the unit 'uname' for 'uid'.
+ * Returns 0 on success or -1 if the name doesn't fit or is invalid.
+ */
+static int unit_name_for_uid(char *buffer, size_t size, const char *uname, int uid)
+{
+	const char *arodot;
+	int rc;
+
+	arodot = strchr(uname, '@');
+	if (arodot && *++arodot == '.') {
+		if (uid < 0)
+			return -1;
+		rc = snprintf(buffer, size, "%.*s%d%s", (int)(arodot - uname), uname, uid, arodot);
+	}
+	else
+		rc = snprintf(buffer, size, "%s", uname);
+	return rc >= 0 && (size_t)rc < size ? 0 : -1;
+}
+
+/*
+ * The units of the applications, as listed by afm_udb_applications_units
+ */
+struct app_units {
+	unsigned count;
+	unsigned size;
+	struct app_unit {
+		const char *id;
+		const char *name;
+		int isuser;
+	} *units;
+};
+
+static void add_app_unit(void *closure, const char *id, const char *name, int isuser)
+{
+	struct app_units *apps = closure;
+	struct app_unit *units;
+	unsigned size;
+
+	if (apps->count == apps->size) {
+		size = apps->size ? 2 * apps->size : 64;
+		units = realloc(apps->units, size * sizeof *units);
+		if (units == NULL)
+			return;
+		apps->units = units;
+		apps->size = size;
+	}
+	units = &apps->units[apps->count++];
+	units->id = id;
+	units->name = name;
+	units->isuser = isuser;
+}
+
+/*
+ * Records a listing of the runners waiting the pids of its scopes
+ */
+struct lister {
+	unsigned pending;		/* count of pending scopes and 1 while launching */
+	struct json_object *result;	/* the list of the runners */
+	void (*callback)(void *closure, struct json_object *list);
+	void *closure;			/* closure of the callback */
+	struct list_scope {
+		struct lister *lister;	/* the listing */
+		int isuser;		/* the scope */
+		unsigned count;		/* count of active applications */
+		char **ids;		/* ids of the active applications */
+		char **dpaths;		/* dpaths of their units */
+	} scopes[2];
+};
+
+/*
+ * Removes a pending scope of 'lister', replying after the last one
+ */
+static void lister_unref(struct lister *lister)
+{
+	unsigned s, i;
+
+	if (--lister->pending == 0) {
+		lister->callback(lister->closure, lister->result);
+		for (s = 0 ; s < 2 ; s++) {
+			for (i = 0 ; i < lister->scopes[s].count ; i++) {
+				free(lister->scopes[s].ids[i]);
+				free(lister->scopes[s].dpaths[i]);
+			}
+			free(lister->scopes[s].ids);
+			free(lister->scopes[s].dpaths);
+		}
+		free(lister);
+	}
+}
+
+/*
+ * Receives the pids of the active applications of a scope
+ */
+static void on_list_pids(void *closure, const int pids[])
+{
+	struct list_scope *scope = closure;
+	struct runner *runner;
 	struct json_object *desc;
-	struct json_object *appli;
-	struct json_object *apps;
-	struct json_object *result;
+	unsigned j;
 
-	apps = NULL;
-	result = json_object_new_array();
-	if (result == NULL)
-		goto error;
+	for (j = 0 ; j < scope->count ; j++) {
+		if (pids[j] > 0) {
+			runner = runner_add(pids[j], scope->isuser, scope->dpaths[j], scope->ids[j]);
+			desc = mkstate(scope->ids[j], pids[j], pids[j], SysD_State_Active,
+					runner != NULL && runner->frozen);
+			if (desc && json_object_array_add(scope->lister->result, desc) == -1) {
+				RP_ERROR("can't add desc %s to result", json_object_get_string(desc));
+				json_object_put(desc);
+			}
+		}
+	}
+	lister_unref(scope->lister);
+}
 
-	apps = afm_udb_applications_private(db, all, uid);
-	n = json_object_array_length(apps);
-	for (i = 0 ; i < n ; i++) {
-		appli = json_object_array_get_idx(apps, i);
-		if (appli && get_basis(appli, &isuser, &udpath, uid) >= 0) {
-			pid = systemd_unit_pid_of_dpath(isuser, udpath);
-			if (pid > 0 && j_read_string_at(appli, "id", &id)) {
-				state = systemd_unit_state_of_dpath(isuser, udpath);
-				if (state == SysD_State_Active) {
-					desc = mkstate(id, pid, pid, state);
-					if (desc && json_object_array_add(result, desc) == -1) {
-						RP_ERROR("can't add desc %s to result", json_object_get_string(desc));
-						json_object_put(desc);
+/*
+ * Get the list of the runners.
+ *
+ * The active units are listed with one call for each scope and
+ * the pids of the active applications are read using pipelined calls.
+ * Only the ids and the units of the applications are read from 'db'.
+ * When the pids are read, 'callback' receives 'closure' and the list
+ * whose reference is transferred.
+ *
+ * Returns 0 if 'callback' is or will be called or -1 in case of error,
+ * 'callback' is then not called.
+ */
+int afm_urun_list_async(struct afm_udb *db, int all, int uid,
+			void (*callback)(void *closure, struct json_object *list), void *closure)
+{
+	unsigned i, n, s;
+	int listed;
+	const char *dpath;
+	char name[PATH_MAX];
+	struct actives actives;
+	struct app_units apps;
+	struct list_scope *scope;
+	struct lister *lister;
+
+	lister = calloc(1, sizeof *lister);
+	if (lister == NULL)
+		goto nomem;
+	lister->result = json_object_new_array();
+	if (lister->result == NULL) {
+		free(lister);
+		goto nomem;
+	}
+	lister->callback = callback;
+	lister->closure = closure;
+	lister->pending = 1;
+
+	/* the strings of apps are valid until the next update of db */
+	memset(&apps, 0, sizeof apps);
+	afm_udb_applications_units(db, all, add_app_unit, &apps);
+	n = apps.count;
+
+	for (s = 0 ; s <= 1 ; s++) {
+		scope = &lister->scopes[s];
+		scope->lister = lister;
+		scope->isuser = s ? user_scope(uid) : 0;
+		scope->ids = malloc(n * sizeof *scope->ids);
+		scope->dpaths = malloc(n * sizeof *scope->dpaths);
+		if (n && (scope->ids == NULL || scope->dpaths == NULL)) {
+			RP_ERROR("out of memory");
+			continue;
+		}
+
+		/* search the active applications of the scope */
+		memset(&actives, 0, sizeof actives);
+		listed = 0;
+		for (i = 0 ; i < n ; i++) {
+			if (!apps.units[i].isuser == !s
+			 && unit_name_for_uid(name, sizeof name, apps.units[i].name, uid) == 0) {
+				if (!listed) {
+					list_actives(&actives, scope->isuser);
+					listed = 1;
+				}
+				dpath = search_active(&actives, name);
+				if (dpath) {
+					scope->ids[scope->count] = strdup(apps.units[i].id);
+					scope->dpaths[scope->count] = strdup(dpath);
+					if (scope->ids[scope->count] && scope->dpaths[scope->count])
+						scope->count++;
+					else {
+						free(scope->ids[scope->count]);
+						free(scope->dpaths[scope->count]);
 					}
 				}
 			}
 		}
+		free_actives(&actives);
+
+		/* get asynchronously the pids of the active applications */
+		if (scope->count) {
+			lister->pending++;
+			if (systemd_units_pid_of_dpaths_async(scope->isuser, scope->count,
+					(const char * const *)scope->dpaths, on_list_pids, scope) < 0)
+				lister->pending--;
+		}
 	}
+	free(apps.units);
+	lister_unref(lister);
+	return 0;
 
-error:
-	json_object_put(apps);
-	return result;
+nomem:
+	RP_ERROR("out of memory");
+	errno = ENOMEM;
+	return -1;
 }
 
 /*
@@ -417,46 +1537,59 @@ error:
  */
 struct json_object *afm_urun_state(struct afm_udb *db, int runid, int uid)
 {
-	rp_jsonc_index_t i, n;
-	int isuser, pid, wasuser;
-	char *dpath;
+	int isuser, pid, wasuser, frozen, instance;
+	char *dpath, *id;
 	const char *udpath;
-	const char *id;
 	enum SysD_State state;
+	struct runner *runner;
 	struct json_object *appli;
-	struct json_object *apps;
 	struct json_object *result;
 
 	result = NULL;
 
+	/* search the recorded runners, on mismatch ask systemd */
+	runner = runner_of_runid(runid);
+	if (runner) {
+		appli = afm_udb_get_application_private(db, runner->id, uid);
+		if (appli
+		 && get_basis(appli, &isuser, &udpath, uid, 0) >= 0
+		 && isuser == runner->isuser
+		 && !strcmp(udpath, runner->dpath))
+			result = mkstate(runner->id, runid, runid, SysD_State_Active, runner->frozen);
+		json_object_put(appli);
+		if (result)
+			return result;
+	}
+
 	/* get the dpath */
-	dpath = systemd_unit_dpath_by_pid(wasuser = 1, (unsigned)runid);
+	dpath = systemd_unit_dpath_by_pid(wasuser = user_scope(uid), (unsigned)runid);
 	if (!dpath)
 		dpath = systemd_unit_dpath_by_pid(wasuser = 0, (unsigned)runid);
 	if (!dpath) {
 		errno = EINVAL;
 		RP_WARNING("searched runid %d not found", runid);
 	} else {
-		/* search in the base */
-		apps = afm_udb_applications_private(db, 1, uid);
-		n = json_object_array_length(apps);
-		for (i = 0 ; i < n ; i++) {
-			appli = json_object_array_get_idx(apps, i);
-			if (appli
-			 && get_basis(appli, &isuser, &udpath, uid) >= 0
-			 && !strcmp(dpath, udpath)
-			 && j_read_string_at(appli, "id", &id)) {
-				pid = systemd_unit_pid_of_dpath(isuser, udpath);
-				state = systemd_unit_state_of_dpath(isuser, dpath);
-				if (pid > 0 && state == SysD_State_Active)
-					result = mkstate(id, runid, pid, state);
-				goto end;
+		/* search in the base the application of the unit */
+		isuser = wasuser;
+		id = id_of_dpath(db, isuser, dpath, &instance);
+		if (id != NULL && (instance < 0 || instance == uid)) {
+			pid = systemd_unit_pid_of_dpath(isuser, dpath);
+			state = systemd_unit_state_of_dpath(isuser, dpath);
+			if (pid > 0 && state == SysD_State_Active) {
+				frozen = systemd_unit_is_frozen_dpath(isuser, dpath) > 0;
+				if (pid == runid) {
+					runner = runner_add(runid, isuser, dpath, id);
+					if (runner)
+						runner->frozen = frozen;
+				}
+				result = mkstate(id, runid, pid, state, frozen);
 			}
 		}
-		errno = ENOENT;
-		RP_WARNING("searched runid %d of dpath %s isn't an applications", runid, dpath);
-end:
-		json_object_put(apps);
+		else {
+			errno = ENOENT;
+			RP_WARNING("searched runid %d of dpath %s isn't an applications", runid, dpath);
+		}
+		free(id);
 		free(dpath);
 	}
 
@@ -471,6 +1604,7 @@ int afm_urun_search_runid(struct afm_udb *db, const char *id, int uid)
 {
 	int isuser, pid;
 	const char *udpath;
+	struct runner *runner;
 	struct json_object *appli;
 
 	appli = afm_udb_get_application_private(db, id, uid);
@@ -478,15 +1612,58 @@ int afm_urun_search_runid(struct afm_udb *db, const char *id, int uid)
 		RP_NOTICE("Unknown appid %s", id);
 		errno = ENOENT;
 		pid = -1;
-	} else if (get_basis(appli, &isuser, &udpath, uid) < 0) {
+	} else if (get_basis(appli, &isuser, &udpath, uid, 0) < 0) {
 		pid = -1;
+	} else if ((runner = runner_of_dpath(isuser, udpath)) != NULL) {
+		pid = runner->runid;
 	} else {
 		pid = systemd_unit_pid_of_dpath(isuser, udpath);
+#if AFM_URUN_LOCAL_DPATH
+		/* on failure, retry with the path given by LoadUnit */
+		if (pid < 0 && get_basis(appli, &isuser, &udpath, uid, 1) >= 0)
+			pid = systemd_unit_pid_of_dpath(isuser, udpath);
+#endif
 		if (pid == 0) {
 			errno = ESRCH;
 			pid = -1;
 		}
+		else if (pid > 0)
+			runner_add(pid, isuser, udpath, id);
 	}
+	json_object_put(appli);
 	return pid;
 }
 
+/*
+ * Get the statistics of the starts of the application 'id'
+ * or of all applications if 'id' is NULL. The statistics give
+ * for each phase of the starts the percentiles 50, 95 and 99 and the
+ * maximum of the durations in microseconds of the last starts.
+ *
+ * Returns the statistics or NULL in case of error.
+ */
+struct json_object *afm_urun_stats(const char *id)
+{
+	struct app_stats *stats;
+	struct json_object *result, *item, *phases;
+	unsigned count, phase;
+
+	result = json_object_new_object();
+	for (stats = all_stats ; result && stats ; stats = stats->next) {
+		if (id == NULL || !strcmp(id, stats->id)) {
+			item = NULL;
+			phases = NULL;
+			rp_jsonc_pack(&item, "{si}", "count", (int)stats->count);
+			if (item)
+				phases = j_add_new_object(item, "phases");
+			if (phases) {
+				count = stats->count < AFM_URUN_STATS_SAMPLES ? stats->count : AFM_URUN_STATS_SAMPLES;
+				for (phase = 0 ; phase < Phase_Count ; phase++)
+					json_object_object_add(phases, phase_names[phase],
+						stats_phase(stats->samples[phase], count));
+			}
+			json_object_object_add(result, stats->id, item);
+		}
+	}
+	return result;
+}
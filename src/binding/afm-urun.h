@@ -26,10 +26,19 @@ struct afm_udb;
 
 extern int afm_urun_start(struct json_object *appli, int uid);
 extern int afm_urun_once(struct json_object *appli, int uid);
+extern int afm_urun_once_async(struct json_object *appli, int uid,
+			void (*callback)(void *closure, int runid), void *closure);
+extern int afm_urun_start_many(unsigned count, struct json_object *applis[], int uid,
+			void (*callback)(void *closure, const int runids[]), void *closure);
 extern int afm_urun_terminate(int runid, int uid);
-extern int afm_urun_pause(int runid, int uid);
-extern int afm_urun_resume(int runid, int uid);
-extern struct json_object *afm_urun_list(struct afm_udb *db, int all, int uid);
+extern int afm_urun_pause(struct afm_udb *db, int runid, int uid);
+extern int afm_urun_resume(struct afm_udb *db, int runid, int uid);
+extern int afm_urun_list_async(struct afm_udb *db, int all, int uid,
+			void (*callback)(void *closure, struct json_object *list), void *closure);
 extern struct json_object *afm_urun_state(struct afm_udb *db, int runid, int uid);
 extern int afm_urun_search_runid(struct afm_udb *db, const char *id, int uid);
+extern struct json_object *afm_urun_stats(const char *id);
+extern int afm_urun_listen(struct afm_udb *db,
+			void (*callback)(void *closure, enum SysD_State state, struct json_object *desc),
+			void *closure);
 
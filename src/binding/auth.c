@@ -24,6 +24,12 @@
 #define _GNU_SOURCE         /* See feature_test_macros(7) */
 
 #include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <json-c/json.h>
 
 #define AFB_BINDING_VERSION 4
 #include <afb/afb-binding.h>
@@ -36,6 +42,58 @@
 #define CKAUTH_STACK_DEPTH 8
 #endif
 
+/*
+ * The decisions of auth_check are cached per session. Only the checks
+ * made by auth_check, those of the parameters "all" and "uid", are
+ * cached: the checks of the verbs (the field auth of the verbs) are
+ * made by the binder and are not cached.
+ * The permissions database doesn't signal its changes: a revoked
+ * permission remains granted until its decision expires, or until
+ * auth_flush is called when applications change.
+ */
+
+/* count of decisions cached per session, 0 for no cache */
+#if !defined(AUTH_CACHE_SIZE)
+#define AUTH_CACHE_SIZE 16
+#endif
+
+/* time to live of the cached decisions in seconds */
+#if !defined(AUTH_CACHE_TTL_SECONDS)
+#define AUTH_CACHE_TTL_SECONDS 5
+#endif
+
+#if AUTH_CACHE_SIZE
+
+/**
+ * a cached decision
+ */
+struct decision {
+	const afb_auth_t *auth;
+	int granted;
+	time_t expire;
+};
+
+/**
+ * the decisions cached in the context of a session
+ * for the credentials of its client
+ */
+struct cache {
+	unsigned epoch;
+	int uid;
+	int gid;
+	char *label;
+	unsigned count;
+	struct decision decisions[AUTH_CACHE_SIZE];
+};
+
+/* the lock of the caches */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the epoch of the caches, incremented when permissions change */
+static unsigned cache_epoch;
+
+#endif
+
 /**
  * structure for checking temporarily check permission synchronously */
 struct ckauth {
@@ -45,17 +103,168 @@ struct ckauth {
 	void (*callback)(void *closure, int status, void *extra);
 	void *closure;
 	void *extra;
+#if AUTH_CACHE_SIZE
+	unsigned epoch;
+	const afb_auth_t *auth;
+#endif
 };
 
 /* predeclaration */
 static void cka_push(struct ckauth *cka, const afb_auth_t *auth);
 
+#if AUTH_CACHE_SIZE
+
+static time_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void cache_free(void *value)
+{
+	struct cache *cache = value;
+
+	free(cache->label);
+	free(cache);
+}
+
+static int cache_create(void *closure, void **value, void (**freecb)(void*), void **freeclo)
+{
+	struct cache *cache = calloc(1, sizeof *cache);
+
+	*value = *freeclo = cache;
+	*freecb = cache_free;
+	return cache == NULL ? -ENOMEM : 0;
+}
+
+/*
+ * Get the cache of the session of 'req' and the credentials of its client.
+ * Must be called unlocked.
+ */
+static struct cache *cache_of(afb_req_t req, int *uid, int *gid, const char **label)
+{
+	void *value;
+	struct json_object *clifo, *obj;
+
+	if (afb_req_context(req, &value, cache_create, NULL) < 0 || value == NULL)
+		return NULL;
+
+	*uid = *gid = -1;
+	*label = "";
+	clifo = afb_req_get_client_info(req);
+	if (clifo != NULL) {
+		if (json_object_object_get_ex(clifo, "uid", &obj))
+			*uid = json_object_get_int(obj);
+		if (json_object_object_get_ex(clifo, "gid", &obj))
+			*gid = json_object_get_int(obj);
+		if (json_object_object_get_ex(clifo, "label", &obj))
+			*label = json_object_get_string(obj);
+	}
+	return value;
+}
+
+/*
+ * Empties 'cache' if the credentials of the client or the permissions
+ * changed. Must be called locked.
+ */
+static void cache_renew(struct cache *cache, int uid, int gid, const char *label)
+{
+	if (cache->epoch != cache_epoch
+	 || cache->uid != uid
+	 || cache->gid != gid
+	 || cache->label == NULL
+	 || strcmp(cache->label, label)) {
+		free(cache->label);
+		cache->label = strdup(label);
+		cache->epoch = cache_epoch;
+		cache->uid = uid;
+		cache->gid = gid;
+		cache->count = 0;
+	}
+}
+
+/*
+ * Search in 'cache' the decision for 'auth'.
+ * Returns 1 if granted, 0 if denied or -1 if not cached.
+ * Must be called locked.
+ */
+static int cache_search(struct cache *cache, const afb_auth_t *auth)
+{
+	unsigned idx;
+	time_t t = now();
+
+	for (idx = 0 ; idx < cache->count ; idx++)
+		if (cache->decisions[idx].auth == auth)
+			return cache->decisions[idx].expire > t ? cache->decisions[idx].granted : -1;
+	return -1;
+}
+
+/*
+ * Records in 'cache' the decision for 'auth', replacing the decision
+ * of the same auth or the oldest one when full.
+ * Must be called locked.
+ */
+static void cache_record(struct cache *cache, const afb_auth_t *auth, int granted)
+{
+	unsigned idx, old;
+
+	for (idx = old = 0 ; idx < cache->count && cache->decisions[idx].auth != auth ; idx++)
+		if (cache->decisions[idx].expire < cache->decisions[old].expire)
+			old = idx;
+	if (idx == cache->count && cache->count == AUTH_CACHE_SIZE)
+		idx = old;
+	else if (idx == cache->count)
+		cache->count++;
+	cache->decisions[idx].auth = auth;
+	cache->decisions[idx].granted = granted;
+	cache->decisions[idx].expire = now() + AUTH_CACHE_TTL_SECONDS;
+}
+
+/*
+ * Records the decision 'granted' of the check 'cka' unless
+ * permissions changed since the check started.
+ */
+static void cka_record(struct ckauth *cka, int granted)
+{
+	struct cache *cache;
+	int uid, gid;
+	const char *label;
+
+	/* the session may have been closed, get its cache again */
+	cache = cache_of(cka->req, &uid, &gid, &label);
+	if (cache != NULL) {
+		pthread_mutex_lock(&cache_lock);
+		if (cka->epoch == cache_epoch) {
+			cache_renew(cache, uid, gid, label);
+			cache_record(cache, cka->auth, granted);
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+}
+
+#endif
+
+void auth_flush(void)
+{
+#if AUTH_CACHE_SIZE
+	pthread_mutex_lock(&cache_lock);
+	cache_epoch++;
+	pthread_mutex_unlock(&cache_lock);
+#endif
+}
 
 static void cka_end(struct ckauth *cka, int status)
 {
 	void (*callback)(void*,int,void*) = cka->callback;
 	void *closure = cka->closure;
 	void *extra = cka->extra;
+#if AUTH_CACHE_SIZE
+	/* errors are not cached */
+	if (status >= 0)
+		cka_record(cka, status > 0);
+#endif
 	free(cka);
 	callback(closure, status, extra);
 }
@@ -132,7 +341,31 @@ void auth_check(
 	void *closure,
 	void *extra
 ) {
-	struct ckauth *cka = malloc(sizeof *cka);
+	struct ckauth *cka;
+#if AUTH_CACHE_SIZE
+	struct cache *cache;
+	int status, uid, gid;
+	const char *label;
+	unsigned epoch;
+
+	/* search a cached decision */
+	cache = cache_of(req, &uid, &gid, &label);
+	pthread_mutex_lock(&cache_lock);
+	epoch = cache_epoch;
+	if (cache == NULL)
+		status = -1;
+	else {
+		cache_renew(cache, uid, gid, label);
+		status = cache_search(cache, auth);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if (status >= 0) {
+		callback(closure, status, extra);
+		return;
+	}
+#endif
+
+	cka = malloc(sizeof *cka);
 	if (cka == NULL)
 		callback(closure, -ENOMEM, extra);
 	else {
@@ -141,6 +374,10 @@ void auth_check(
 		cka->callback = callback;
 		cka->closure = closure;
 		cka->extra = extra;
+#if AUTH_CACHE_SIZE
+		cka->epoch = epoch;
+		cka->auth = auth;
+#endif
 		cka_push(cka, auth);
 	}
 }
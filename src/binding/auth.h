@@ -22,6 +22,7 @@
  $RP_END_LICENSE$
 */
 
+/* checks 'auth' for 'req', the decisions are cached for a short time */
 extern
 void auth_check(
 	afb_req_t req,
@@ -30,3 +31,7 @@ void auth_check(
 	void *closure,
 	void *extra
 );
+
+/* forget the cached decisions, to be called when permissions change */
+extern
+void auth_flush(void);
@@ -0,0 +1,330 @@
+/*
+ Copyright (C) 2015-2026 IoT.bzh Company
+
+ Author: José Bollo <jose.bollo@iot.bzh>
+
+ $RP_BEGIN_LICENSE$
+ Commercial License Usage
+  Licensees holding valid commercial IoT.bzh licenses may use this file in
+  accordance with the commercial license agreement provided with the
+  Software or, alternatively, in accordance with the terms contained in
+  a written agreement between you and The IoT.bzh Company. For licensing terms
+  and conditions see https://www.iot.bzh/terms-conditions. For further
+  information use the contact form at https://www.iot.bzh/contact.
+
+ GNU General Public License Usage
+  Alternatively, this file may be used under the terms of the GNU General
+  Public license version 3. This license is as published by the Free Software
+  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+  of this file. Please review the following information to ensure the GNU
+  General Public License requirements will be met
+  https://www.gnu.org/licenses/gpl-3.0.html.
+ $RP_END_LICENSE$
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <json-c/json.h>
+
+#include "unit-fs.h"
+#include "afm-udb.h"
+
+#define MIN_COUNT     100
+#define MAX_COUNT     20000
+#define DEF_COUNT     1000
+#define PREFIX        "afm-"
+#define SNAPSHOT      "afm-udb.snapshot"
+
+static const char *dirname = "/tmp";
+static int rounds = 3;
+
+/* current monotonic time in seconds */
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* peak resident memory in kilobytes */
+static long peak_rss()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+static void fail(const char *what)
+{
+	fprintf(stderr, "error %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+/* creates in 'root' the synthetic units of 'count' applications */
+static void generate(const char *root, int count)
+{
+	char path[PATH_MAX];
+	struct timespec times[2];
+	FILE *file;
+	int idx;
+
+	/* the units are made old enough for being recorded in snapshots */
+	clock_gettime(CLOCK_REALTIME, &times[0]);
+	times[0].tv_sec -= 10;
+	times[1] = times[0];
+
+	snprintf(path, sizeof path, "%s/system", root);
+	if (mkdir(path, 0755) < 0)
+		fail("mkdir");
+	for (idx = 0 ; idx < count ; idx++) {
+		snprintf(path, sizeof path, "%s/system/" PREFIX "bench-app-%05d.service", root, idx);
+		file = fopen(path, "w");
+		if (file == NULL)
+			fail("fopen");
+		fprintf(file,
+			"[Unit]\n"
+			"Description=Benchmark application %1$d\n"
+			"X-AFM-id=bench-app-%1$05d\n"
+			"X-AFM-name=Bench App %1$d\n"
+			"X-AFM-version=1.%1$d\n"
+			"X-AFM-description=Synthetic application %1$d used for measuring afm-udb\n"
+			"X-AFM-shortname=bench%1$d\n"
+			"X-AFM-author=IoT.bzh\n"
+			"X-AFM-icon=/usr/share/icons/bench-app-%1$05d.png\n"
+			"X-AFM-type=application/vnd.agl.native\n"
+			"X-AFM--visibility=%2$s\n"
+			"X-AFM--ID=%3$d\n"
+			"X-AFM--wgt-rootdir=/redpesk/bench-app-%1$05d\n"
+			"X-AFM--rundir=/run/user/%%i/apis/ws\n"
+			"X-AFM--required-api=bench-api-%4$d\n"
+			"\n"
+			"[Service]\n"
+			"ExecStart=/redpesk/bench-app-%1$05d/bin/bench\n",
+			idx, idx % 8 ? "visible" : "hidden", 1000 + idx, idx % 16);
+		fclose(file);
+		utimensat(AT_FDCWD, path, times, 0);
+	}
+	snprintf(path, sizeof path, "%s/system", root);
+	utimensat(AT_FDCWD, path, times, 0);
+}
+
+/* removes the units of 'count' applications from 'root' */
+static void clean(const char *root, int count)
+{
+	char path[PATH_MAX];
+	int idx;
+
+	for (idx = 0 ; idx < count ; idx++) {
+		snprintf(path, sizeof path, "%s/system/" PREFIX "bench-app-%05d.service", root, idx);
+		unlink(path);
+	}
+	snprintf(path, sizeof path, "%s/system", root);
+	rmdir(path);
+	snprintf(path, sizeof path, "%s/" SNAPSHOT, root);
+	unlink(path);
+	rmdir(root);
+}
+
+/* print the result of a measure of 'count' operations lasting 'duration' */
+static void report(int count, const char *what, double duration, int ops)
+{
+	printf("%6d  %-24s %10.3f ms %10.3f us/op  %8ld kB\n",
+		count, what, duration * 1e3, duration * 1e6 / ops, peak_rss());
+}
+
+/* the fields and the filters of the projected list */
+static const char * const names[] = { "id", "name", "icon" };
+static const char * const filters[][2] = { { "type", "application/vnd.agl.native" } };
+static const char * const nullfilter[][2] = { { "id", NULL } };
+
+/* measures the database of 'count' applications */
+static void bench(int count)
+{
+	char root[PATH_MAX], snapshot[PATH_MAX], id[40];
+	struct afm_udb *afudb;
+	struct afm_udb_text *shared;
+	struct json_object *obj;
+	const char *text;
+	size_t length;
+	double start, duration;
+	int idx, round, found;
+
+	/* prepare the units */
+	snprintf(root, sizeof root, "%s/bench-udb-XXXXXX", dirname);
+	if (mkdtemp(root) == NULL)
+		fail("mkdtemp");
+	snprintf(snapshot, sizeof snapshot, "%s/" SNAPSHOT, root);
+	generate(root, count);
+	units_fs_set_root_dir(root);
+
+	/* creation by scanning the units */
+	duration = 0;
+	for (round = 0 ; round < rounds ; round++) {
+		start = now();
+		afudb = afm_udb_create(1, 0, PREFIX, NULL);
+		duration += now() - start;
+		if (afudb == NULL)
+			fail("afm_udb_create");
+		afm_udb_unref(afudb);
+	}
+	report(count, "create", duration / rounds, count);
+
+	/* creation using a snapshot, the first creation records it */
+	afudb = afm_udb_create(1, 0, PREFIX, snapshot);
+	if (afudb == NULL)
+		fail("afm_udb_create");
+	afm_udb_unref(afudb);
+	duration = 0;
+	for (round = 0 ; round < rounds ; round++) {
+		start = now();
+		afudb = afm_udb_create(1, 0, PREFIX, snapshot);
+		duration += now() - start;
+		if (afudb == NULL)
+			fail("afm_udb_create");
+		afm_udb_unref(afudb);
+	}
+	report(count, "create (snapshot)", duration / rounds, count);
+
+	/* full update */
+	afudb = afm_udb_create(1, 0, PREFIX, NULL);
+	if (afudb == NULL)
+		fail("afm_udb_create");
+	duration = 0;
+	for (round = 0 ; round < rounds ; round++) {
+		start = now();
+		if (afm_udb_update(afudb, NULL) < 0)
+			fail("afm_udb_update");
+		duration += now() - start;
+	}
+	report(count, "update", duration / rounds, count);
+
+	/* case insensitive lookups */
+	found = 0;
+	start = now();
+	for (idx = 0 ; idx < count ; idx++) {
+		snprintf(id, sizeof id, "BENCH-App-%05d", (idx * 7919) % count);
+		obj = afm_udb_get_application_public(afudb, id, 0);
+		found += obj != NULL;
+		json_object_put(obj);
+	}
+	duration = now() - start;
+	if (found != count) {
+		fprintf(stderr, "error lookup: %d found of %d\n", found, count);
+		exit(1);
+	}
+	report(count, "lookup (no case)", duration, count);
+
+	/* serialization of the public list */
+	duration = 0;
+	length = 0;
+	for (round = 0 ; round < rounds ; round++) {
+		start = now();
+		obj = afm_udb_applications_public(afudb, 1, 0);
+		text = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &length);
+		duration += now() - start;
+		if (text == NULL)
+			fail("serialization");
+		json_object_put(obj);
+	}
+	report(count, "public list", duration / rounds, count);
+	printf("%6d  %-24s %10zu bytes\n", count, "public list size", length);
+
+	/* projected and filtered list */
+	duration = 0;
+	length = 0;
+	for (round = 0 ; round < rounds ; round++) {
+		start = now();
+		shared = afm_udb_applications_projected_text(afudb, 1, 0, names, 3, filters, 1, NULL);
+		duration += now() - start;
+		if (shared == NULL)
+			fail("projection");
+		length = afm_udb_text_length(shared);
+		afm_udb_text_unref(shared);
+	}
+	report(count, "projected list", duration / rounds, count);
+	printf("%6d  %-24s %10zu bytes\n", count, "projected list size", length);
+
+	/* a filter without value, like the JSON null, is rejected */
+	shared = afm_udb_applications_projected_text(afudb, 1, 0, names, 3, nullfilter, 1, NULL);
+	if (shared != NULL || errno != EINVAL) {
+		fprintf(stderr, "error projection: null filter accepted\n");
+		exit(1);
+	}
+
+	afm_udb_unref(afudb);
+	clean(root, count);
+}
+
+/* runs the benchmark of 'count' in a child process for isolating its peak RSS */
+static int run(int count)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		fail("fork");
+	if (pid == 0) {
+		bench(count);
+		fflush(stdout);
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		fail("waitpid");
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-d dir] [-r rounds] [count...]\n"
+		"\n"
+		"Measures afm-udb on synthetic trees of 'count' units (%d to %d,\n"
+		"default %d) created in a temporary directory of 'dir' (default /tmp).\n",
+		name, MIN_COUNT, MAX_COUNT, DEF_COUNT);
+	exit(1);
+}
+
+int main(int ac, char **av)
+{
+	int opt, count, rc;
+
+	while ((opt = getopt(ac, av, "d:r:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dirname = optarg;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			if (rounds <= 0)
+				usage(av[0]);
+			break;
+		default:
+			usage(av[0]);
+		}
+	}
+
+	printf("%6s  %-24s %13s %13s  %11s\n", "units", "measure", "time", "time", "peak RSS");
+	if (optind == ac)
+		return run(DEF_COUNT);
+	for (rc = 0 ; optind < ac && !rc ; optind++) {
+		count = atoi(av[optind]);
+		if (count < MIN_COUNT || count > MAX_COUNT)
+			usage(av[0]);
+		rc = run(count);
+	}
+	return rc;
+}
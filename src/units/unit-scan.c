@@ -0,0 +1,195 @@
+/*
+ Copyright (C) 2015-2026 IoT.bzh Company
+
+ Author: José Bollo <jose.bollo@iot.bzh>
+
+ $RP_BEGIN_LICENSE$
+ Commercial License Usage
+  Licensees holding valid commercial IoT.bzh licenses may use this file in
+  accordance with the commercial license agreement provided with the
+  Software or, alternatively, in accordance with the terms contained in
+  a written agreement between you and The IoT.bzh Company. For licensing terms
+  and conditions see https://www.iot.bzh/terms-conditions. For further
+  information use the contact form at https://www.iot.bzh/contact.
+
+ GNU General Public License Usage
+  Alternatively, this file may be used under the terms of the GNU General
+  Public license version 3. This license is as published by the Free Software
+  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+  of this file. Please review the following information to ensure the GNU
+  General Public License requirements will be met
+  https://www.gnu.org/licenses/gpl-3.0.html.
+ $RP_END_LICENSE$
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "unit-scan.h"
+
+/* the empty content of empty files */
+static const char empty[1] = "";
+
+/* is 'c' a blank? */
+static inline int is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+int unit_scan_read(const char *path, const char **content, size_t *length)
+{
+	int fd, rc;
+	struct stat st;
+	char *buffer;
+	size_t size, pos;
+	ssize_t len;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	rc = fstat(fd, &st);
+	if (rc == 0) {
+		size = (size_t)st.st_size;
+		buffer = size ? malloc(size) : NULL;
+		if (size && buffer == NULL) {
+			errno = ENOMEM;
+			rc = -1;
+		}
+		else {
+			/* the file may shrink while read, stop at its end */
+			for (pos = 0 ; pos < size ; pos += (size_t)len) {
+				len = pread(fd, &buffer[pos], size - pos, (off_t)pos);
+				if (len <= 0) {
+					if (len < 0 && errno == EINTR) {
+						len = 0;
+						continue;
+					}
+					if (len < 0)
+						rc = -1;
+					break;
+				}
+			}
+			if (rc < 0 || pos == 0) {
+				free(buffer);
+				*content = empty;
+				*length = 0;
+			}
+			else {
+				*content = buffer;
+				*length = pos;
+			}
+		}
+	}
+	close(fd);
+	return rc;
+}
+
+void unit_scan_release(const char *content, size_t length)
+{
+	if (length)
+		free((void*)content);
+}
+
+void unit_scan_init(struct unit_scan *scan, const char *content, size_t length, const char *prefix)
+{
+	scan->content = content;
+	scan->length = length;
+	scan->position = 0;
+	scan->prefix = prefix;
+	scan->prefixlen = strlen(prefix);
+}
+
+int unit_scan_next(struct unit_scan *scan, const char **name, size_t *namelen, const char **value, size_t *valuelen)
+{
+	const char *content = scan->content, *nl, *eq;
+	size_t pos = scan->position, length = scan->length, begin, end, idx;
+
+	while (pos < length) {
+		/* skip blanks and empty lines */
+		if (is_blank(content[pos]) || content[pos] == '\n') {
+			pos++;
+			continue;
+		}
+
+		/* search the end of the line, including continued lines */
+		begin = pos;
+		for (end = pos ;; end = idx + 1) {
+			nl = memchr(&content[end], '\n', length - end);
+			if (nl == NULL) {
+				end = length;
+				break;
+			}
+			idx = (size_t)(nl - content);
+			if (idx > begin && content[idx - 1] == '\r')
+				idx--;
+			if (idx == begin || content[idx - 1] != '\\') {
+				end = idx;
+				break;
+			}
+			idx = (size_t)(nl - content);
+		}
+		nl = memchr(&content[end], '\n', length - end);
+		pos = nl == NULL ? length : (size_t)(nl - content) + 1;
+
+		/* comments are ignored */
+		if (content[begin] == '#' || content[begin] == ';')
+			continue;
+
+		/* check the prefix and the equal */
+		if (end - begin <= scan->prefixlen
+		 || memcmp(&content[begin], scan->prefix, scan->prefixlen))
+			continue;
+		begin += scan->prefixlen;
+		eq = memchr(&content[begin], '=', end - begin);
+		if (eq == NULL)
+			continue;
+
+		/* get the name and the value without surrounding blanks */
+		idx = (size_t)(eq - content);
+		*name = &content[begin];
+		while (idx > begin && is_blank(content[idx - 1]))
+			idx--;
+		*namelen = idx - begin;
+		idx = (size_t)(eq - content) + 1;
+		while (idx < end && is_blank(content[idx]))
+			idx++;
+		while (end > idx && is_blank(content[end - 1]))
+			end--;
+		*value = &content[idx];
+		*valuelen = end - idx;
+		scan->position = pos;
+		return 1;
+	}
+	scan->position = pos;
+	return 0;
+}
+
+size_t unit_scan_unescape(char *dest, const char *value, size_t length)
+{
+	size_t idx;
+	char c, *write;
+
+	write = dest;
+	for (idx = 0 ; idx < length ; ) {
+		c = value[idx++];
+		if (c == '\r')
+			continue;
+		if (c == '\\' && idx < length) {
+			c = value[idx++];
+			if (c == '\r' && idx < length && value[idx] == '\n')
+				c = value[idx++];
+			switch (c) {
+			case 'n': c = '\n'; break;
+			case '\n': c = ' '; break;
+			default: *write++ = '\\'; break;
+			}
+		}
+		*write++ = c;
+	}
+	*write = 0;
+	return (size_t)(write - dest);
+}
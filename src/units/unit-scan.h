@@ -0,0 +1,101 @@
+/*
+ Copyright (C) 2015-2026 IoT.bzh Company
+
+ Author: José Bollo <jose.bollo@iot.bzh>
+
+ $RP_BEGIN_LICENSE$
+ Commercial License Usage
+  Licensees holding valid commercial IoT.bzh licenses may use this file in
+  accordance with the commercial license agreement provided with the
+  Software or, alternatively, in accordance with the terms contained in
+  a written agreement between you and The IoT.bzh Company. For licensing terms
+  and conditions see https://www.iot.bzh/terms-conditions. For further
+  information use the contact form at https://www.iot.bzh/contact.
+
+ GNU General Public License Usage
+  Alternatively, this file may be used under the terms of the GNU General
+  Public license version 3. This license is as published by the Free Software
+  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+  of this file. Please review the following information to ensure the GNU
+  General Public License requirements will be met
+  https://www.gnu.org/licenses/gpl-3.0.html.
+ $RP_END_LICENSE$
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Iterator on the fields of a unit whose names start with a given prefix.
+ * The fields are returned as slices of the scanned content, no copy
+ * is done. The values are raw: they can include escaped characters
+ * and continued lines, see unit_scan_unescape.
+ */
+struct unit_scan {
+	const char *content;	/**< the scanned content */
+	size_t length;		/**< length of the scanned content */
+	size_t position;	/**< current position of the scan */
+	const char *prefix;	/**< the prefix of the names */
+	size_t prefixlen;	/**< length of the prefix */
+};
+
+/**
+ * Reads in an allocated buffer the unit file of 'path'
+ *
+ * The content is read and not mapped because installers rewrite unit
+ * files in place (truncate then write): accessing a mapping beyond the
+ * new end of such file raises SIGBUS.
+ *
+ * @param path    path of the unit file
+ * @param content where to store the read content
+ * @param length  where to store the length of the read content
+ *
+ * @return 0 on success or -1 with errno set on error
+ */
+extern int unit_scan_read(const char *path, const char **content, size_t *length);
+
+/**
+ * Releases the buffer of the content read by unit_scan_read
+ *
+ * @param content the read content
+ * @param length  the length of the read content
+ */
+extern void unit_scan_release(const char *content, size_t length);
+
+/**
+ * Initialize the iterator 'scan' for scanning the fields of 'content'
+ * whose names start with 'prefix'
+ *
+ * @param scan    the iterator to initialize
+ * @param content the content of a unit file
+ * @param length  the length of the content
+ * @param prefix  the prefix of the names of the fields to scan
+ */
+extern void unit_scan_init(struct unit_scan *scan, const char *content, size_t length, const char *prefix);
+
+/**
+ * Get the next field of the scan
+ *
+ * @param scan     the iterator
+ * @param name     where to store the name of the field (after the prefix)
+ * @param namelen  where to store the length of the name
+ * @param value    where to store the raw value of the field
+ * @param valuelen where to store the length of the raw value
+ *
+ * @return 1 if a field is returned or 0 at end of the content
+ */
+extern int unit_scan_next(struct unit_scan *scan, const char **name, size_t *namelen, const char **value, size_t *valuelen);
+
+/**
+ * Copies in 'dest' the raw 'value' of 'length' translating its escaped
+ * characters and continued lines. The destination must be at least
+ * of 'length + 1' bytes, the copy is terminated by a zero.
+ *
+ * @param dest   the destination
+ * @param value  the raw value to unescape
+ * @param length the length of the raw value
+ *
+ * @return the length of the copy
+ */
+extern size_t unit_scan_unescape(char *dest, const char *value, size_t length);
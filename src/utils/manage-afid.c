@@ -31,10 +31,9 @@
 #include <errno.h>
 
 #include <rp-utils/rp-verbose.h>
-#include <rp-utils/rp-file.h>
 
-#include "normalize-unit-file.h"
 #include "unit-fs.h"
+#include "unit-scan.h"
 
 static const char key_afm_prefix[] = "X-AFM-";
 static const char key_afid[] = "ID";
@@ -54,39 +53,31 @@ static uint32_t afids_array[AFID_ACNT];
 
 static int get_afid_cb(void *closure, const char *name, const char *path, int isuser)
 {
-	char *iter;
-	char *content;
-	size_t length;
+	struct unit_scan scan;
+	const char *content, *key, *value;
+	size_t length, klen, vlen, idx;
 	int rc, p;
 
 	/* reads the file */
-	rc = rp_file_get(path, &content, &length);
+	rc = unit_scan_read(path, &content, &length);
 	if (rc < 0)
 		return rc;
 
-	/* normalize the unit file */
-	normalize_unit_file(content);
-
 	/* process the file */
-	iter = strstr(content, key_afm_prefix);
-	while (iter) {
-		iter += sizeof key_afm_prefix - 1;
-		if (*iter == '-')
-			iter++;
-		if (!strncmp(iter, key_afid, sizeof key_afid - 1)) {
-			iter += sizeof key_afid - 1;
-			while(*iter && *iter != '=' && *iter != '\n')
-				iter++;
-			if (*iter == '=') {
-				while(*++iter == ' ');
-				p = atoi(iter);
-				if (AFID_IS_VALID(p))
-					AFID_SET(afids_array, p);
-			}
+	unit_scan_init(&scan, content, length, key_afm_prefix);
+	while (unit_scan_next(&scan, &key, &klen, &value, &vlen)) {
+		if (klen && *key == '-') {
+			key++;
+			klen--;
+		}
+		if (klen == sizeof key_afid - 1 && !memcmp(key, key_afid, klen)) {
+			for (p = 0, idx = 0 ; idx < vlen && p <= AFID_MAX && '0' <= value[idx] && value[idx] <= '9' ; idx++)
+				p = 10 * p + (value[idx] - '0');
+			if (AFID_IS_VALID(p))
+				AFID_SET(afids_array, p);
 		}
-		iter = strstr(iter, key_afm_prefix);
 	}
-	free(content);
+	unit_scan_release(content, length);
 	return 0;
 }
 
@@ -30,17 +30,20 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #if !NO_LIBSYSTEMD
 # include <systemd/sd-bus.h>
 # include <systemd/sd-bus-protocol.h>
+# include <systemd/sd-event.h>
 #else
   struct sd_bus;
   struct sd_bus_message;
   typedef struct { const char *name; const char *message; } sd_bus_error;
 # define sd_bus_unref(...)                ((void)0)
+# define sd_bus_ref(...)                  ((void)0)
 # define sd_bus_default_user(p)           ((*(p)=NULL),(-ENOTSUP))
 # define sd_bus_default_system(p)         ((*(p)=NULL),(-ENOTSUP))
 # define sd_bus_call_method(...)          (-ENOTSUP)
@@ -55,15 +58,20 @@
 
 static const char sdb_destination[] = "org.freedesktop.systemd1";
 static const char sdb_path[]        = "/org/freedesktop/systemd1";
+static const char sdb_unit_path[]   = "/org/freedesktop/systemd1/unit";
 
 static const char sdbi_job[]     = "org.freedesktop.systemd1.Job";
+static const char sdbi_props[]   = "org.freedesktop.DBus.Properties";
 static const char sdbi_manager[] = "org.freedesktop.systemd1.Manager";
 static const char sdbi_service[] = "org.freedesktop.systemd1.Service";
 static const char sdbi_unit[]    = "org.freedesktop.systemd1.Unit";
 
 static const char sdbp_active_state[]  = "ActiveState";
 static const char sdbp_exec_main_pid[] = "ExecMainPID";
+static const char sdbp_freezer_state[] = "FreezerState";
 
+static const char sdbm_freeze[]            = "Freeze";
+static const char sdbm_get[]               = "Get";
 static const char sdbm_get_unit[]          = "GetUnit";
 static const char sdbm_get_unit_by_pid[]   = "GetUnitByPID";
 static const char sdbm_list_unit_pattern[] = "ListUnitsByPatterns";
@@ -76,6 +84,10 @@ static const char sdbm_start[]             = "Start";
 static const char sdbm_start_unit[]        = "StartUnit";
 static const char sdbm_stop[]              = "Stop";
 static const char sdbm_stop_unit[]         = "StopUnit";
+static const char sdbm_subscribe[]         = "Subscribe";
+static const char sdbm_thaw[]              = "Thaw";
+static const char sdbs_job_removed[]       = "JobRemoved";
+static const char sdbs_props_changed[]     = "PropertiesChanged";
 
 static const char *sds_state_names[] = {
 	NULL,
@@ -87,8 +99,38 @@ static const char *sds_state_names[] = {
 	"failed"
 };
 
+/* maximum count of connections to buses of users */
+#if !defined(SYSTEMD_BUS_POOL_SIZE)
+#define SYSTEMD_BUS_POOL_SIZE 8
+#endif
+
+/* connections to buses of users idle for this delay are closed */
+#if !defined(SYSTEMD_BUS_IDLE_SECONDS)
+#define SYSTEMD_BUS_IDLE_SECONDS 300
+#endif
+
+/* address of the private socket of the manager of the user of uid %d */
+#if !defined(SYSTEMD_USER_BUS_ADDRESS)
+#define SYSTEMD_USER_BUS_ADDRESS "unix:path=/run/user/%d/systemd/private"
+#endif
+
 static struct sd_bus *sysbus;
 static struct sd_bus *usrbus;
+static struct sd_bus *subscribed[2];
+
+#if !NO_LIBSYSTEMD
+/*
+ * Records a connection to the bus of a user
+ */
+struct pooled_bus {
+	struct sd_bus *bus;	/* the bus or NULL when free */
+	int uid;		/* uid of the user */
+	int subscribed;		/* is subscribed to signals of systemd? */
+	time_t used;		/* time of last use */
+};
+
+static struct pooled_bus buspool[SYSTEMD_BUS_POOL_SIZE];
+#endif
 
 /*
  * Translate systemd errors to errno errors
@@ -111,9 +153,101 @@ static int errno2sderr(int rc)
 }
 */
 
+#if !NO_LIBSYSTEMD
+/********************************************************************
+ * Routines for managing connections to buses of users
+ *******************************************************************/
+
+static time_t now_sec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Opens in 'ret' a connection to the manager of the user 'uid' through its
+ * private socket, a direct connection not depending on a session bus.
+ * The connection is attached to the event loop of the system bus if any
+ * before being started so that it doesn't block: the connection and the
+ * authentication are then processed by the loop and the first calls wait
+ * for them.
+ */
+static int open_uid_bus(int uid, struct sd_bus **ret)
+{
+	int rc;
+	char address[sizeof SYSTEMD_USER_BUS_ADDRESS + 20];
+	struct sd_bus *bus;
+	struct sd_event *event;
+
+	snprintf(address, sizeof address, SYSTEMD_USER_BUS_ADDRESS, uid);
+	rc = sd_bus_new(&bus);
+	if (rc < 0)
+		return rc;
+	rc = sd_bus_set_address(bus, address);
+	if (rc >= 0 && sysbus != NULL && (event = sd_bus_get_event(sysbus)) != NULL)
+		rc = sd_bus_attach_event(bus, event, 0);
+	if (rc >= 0)
+		rc = sd_bus_start(bus);
+	if (rc < 0)
+		sd_bus_unref(bus);
+	else
+		*ret = bus;
+	return rc;
+}
+
+/*
+ * Returns in 'ret' the bus of the user 'uid', connecting it if needed.
+ * Connections idle for too long are closed and the least recently used
+ * connection is closed when the pool is full.
+ * Returns 0 in case of success or -1 in case of error
+ */
+static int get_uid_bus(int uid, struct sd_bus **ret)
+{
+	int rc;
+	time_t now;
+	struct pooled_bus *pb, *found, *avail, *oldest;
+
+	/* search the bus, drop idle ones */
+	now = now_sec();
+	found = avail = oldest = NULL;
+	for (pb = buspool ; pb < &buspool[SYSTEMD_BUS_POOL_SIZE] ; pb++) {
+		if (pb->bus != NULL && pb->uid != uid && now - pb->used > SYSTEMD_BUS_IDLE_SECONDS)
+			pb->bus = sd_bus_unref(pb->bus);
+		if (pb->bus == NULL) {
+			if (avail == NULL)
+				avail = pb;
+		}
+		else if (pb->uid == uid)
+			found = pb;
+		else if (oldest == NULL || pb->used < oldest->used)
+			oldest = pb;
+	}
+
+	/* connect if not found */
+	if (found == NULL) {
+		if (avail == NULL) {
+			avail = oldest;
+			avail->bus = sd_bus_unref(avail->bus);
+		}
+		rc = open_uid_bus(uid, &avail->bus);
+		if (rc < 0)
+			return sderr2errno(rc);
+		avail->uid = uid;
+		avail->subscribed = 0;
+		found = avail;
+	}
+	found->used = now;
+	*ret = found->bus;
+	return 0;
+}
+#endif
+
 /*
  * Returns in 'ret' either the system bus (if isuser==0)
- * or the user bus (if isuser!=0).
+ * or the user bus (if isuser==1) or the bus of the user of 'uid'
+ * if isuser==SYSTEMD_ISUSER_UID(uid).
  * Returns 0 in case of success or -1 in case of error
  */
 int systemd_get_bus(int isuser, struct sd_bus **ret)
@@ -121,6 +255,13 @@ int systemd_get_bus(int isuser, struct sd_bus **ret)
 	int rc;
 	struct sd_bus *bus;
 
+	if (isuser > 1)
+#if !NO_LIBSYSTEMD
+		return get_uid_bus(isuser - 2, ret);
+#else
+		return seterrno(ENOTSUP);
+#endif
+
 	bus = isuser ? usrbus : sysbus;
 	if (bus)
 		*ret = bus;
@@ -143,24 +284,26 @@ error:
 void systemd_set_bus(int isuser, struct sd_bus *bus)
 {
 	struct sd_bus **target = isuser ? &usrbus : &sysbus;
+	if (bus)
+		sd_bus_ref(bus);
 	if (*target)
 		sd_bus_unref(*target);
 	*target = bus;
 }
 
-#if 0
 /********************************************************************
  * routines for escaping unit names to compute dbus path of units
  *******************************************************************/
 /*
- * Should the char 'c' be escaped?
+ * Should the char 'c' be escaped? Letters are never escaped, digits
+ * are escaped only at first position, any other char is escaped.
  */
-static inline int should_escape_for_path(char c)
+static inline int should_escape_for_path(char c, int first)
 {
 	if (c >= 'A') {
-		return c <= (c >= 'a' ? 'z' : 'Z');
+		return c > (c >= 'a' ? 'z' : 'Z') || (c > 'Z' && c < 'a');
 	} else {
-		return c >= '0' && c <= '9';
+		return first || c < '0' || c > '9';
 	}
 }
 
@@ -182,28 +325,31 @@ static int unit_escape_for_path(char *path, size_t pathlen, const char *unit)
 	char c;
 
 	c = unit[r = w = 0];
+	if (!c) {
+		/* empty name is escaped as _ */
+		if (w + 1 >= pathlen)
+			goto toolong;
+		path[w++] = '_';
+	}
 	while (c) {
-		if (should_escape_for_path(c)) {
-			if (w + 2 >= pathlen)
+		if (should_escape_for_path(c, r == 0)) {
+			if (w + 3 >= pathlen)
 				goto toolong;
 			path[w++] = '_';
-			path[w++] = d2h((c >> 4) & 15);;
+			path[w++] = d2h((c >> 4) & 15);
 			path[w++] = d2h(c & 15);
 		} else {
-			if (w >= pathlen)
+			if (w + 1 >= pathlen)
 				goto toolong;
 			path[w++] = c;
 		}
 		c = unit[++r];
 	}
-	if (w >= pathlen)
-		goto toolong;
 	path[w] = 0;
 	return 0;
 toolong:
 	return seterrno(ENAMETOOLONG);
 }
-#endif
 
 /********************************************************************
  * Routines for getting paths
@@ -290,6 +436,20 @@ static enum SysD_State unit_state(struct sd_bus *bus, const char *dpath)
 	return resu;
 }
 
+static int unit_is_frozen(struct sd_bus *bus, const char *dpath)
+{
+	int rc;
+	char *st;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	rc = sd_bus_get_property_string(bus, sdb_destination, dpath, sdbi_unit, sdbp_freezer_state, &err, &st);
+	if (rc < 0)
+		return seterrno(-rc);
+	rc = !strcmp(st, "frozen");
+	free(st);
+	return rc;
+}
+
 static int get_job_from_reply(struct sd_bus_message *reply, char **job)
 {
 	int rc;
@@ -350,6 +510,17 @@ static int unit_stop(struct sd_bus *bus, const char *dpath, char **job)
 	return rc;
 }
 
+static int unit_freeze(struct sd_bus *bus, const char *dpath, int freeze)
+{
+	int rc;
+	struct sd_bus_message *ret = NULL;
+	sd_bus_error err = SD_BUS_ERROR_NULL;
+
+	rc = sd_bus_call_method(bus, sdb_destination, dpath, sdbi_unit, freeze ? sdbm_freeze : sdbm_thaw, &err, &ret, NULL);
+	sd_bus_message_unref(ret);
+	return sderr2errno(rc) < 0 ? -1 : 0;
+}
+
 static int unit_start_name(struct sd_bus *bus, const char *name, char **job)
 {
 	int rc;
@@ -402,6 +573,577 @@ static int job_is_pending(struct sd_bus *bus, const char *job)
 	return 1;
 }
 
+#if !NO_LIBSYSTEMD
+/********************************************************************
+ * Routines for waiting jobs and states using signals
+ *******************************************************************/
+
+/*
+ * Records the status of a wait
+ */
+struct waiter {
+	const char *job;	/* the waited job or NULL when done */
+	int changed;		/* should the state be read again? */
+};
+
+/*
+ * Subscribes to the signals of systemd manager of 'bus'
+ * Without subscription, systemd doesn't emit signals of units.
+ * The call is sent without waiting its reply: the messages being
+ * processed in order, the later calls are made subscribed.
+ */
+static int call_subscribe(struct sd_bus *bus)
+{
+	return sd_bus_call_method_async(bus, NULL, sdb_destination, sdb_path, sdbi_manager,
+					sdbm_subscribe, NULL, NULL, NULL);
+}
+
+/*
+ * Returns the sender of the signals of systemd on 'bus'. The signals
+ * received through a direct connection, like the private socket of
+ * the managers of users, have no sender.
+ */
+static const char *signal_sender(struct sd_bus *bus)
+{
+	return sd_bus_is_bus_client(bus) > 0 ? sdb_destination : NULL;
+}
+
+static void subscribe(struct sd_bus *bus, int isuser)
+{
+	struct pooled_bus *pb;
+
+	if (isuser > 1) {
+		for (pb = buspool ; pb < &buspool[SYSTEMD_BUS_POOL_SIZE] ; pb++)
+			if (pb->bus == bus) {
+				if (!pb->subscribed && call_subscribe(bus) >= 0)
+					pb->subscribed = 1;
+				break;
+			}
+	}
+	else if (subscribed[!!isuser] != bus) {
+		if (call_subscribe(bus) >= 0)
+			subscribed[!!isuser] = bus;
+	}
+}
+
+/*
+ * Signal JobRemoved: the waited job is done when removed
+ */
+static int on_job_removed(struct sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	struct waiter *waiter = closure;
+	const char *job, *unit, *result;
+	uint32_t id;
+
+	if (waiter->job
+	 && sd_bus_message_read(msg, "uoss", &id, &job, &unit, &result) >= 0
+	 && !strcmp(job, waiter->job)) {
+		waiter->job = NULL;
+		waiter->changed = 1;
+	}
+	return 0;
+}
+
+/*
+ * Signal PropertiesChanged: the state of the unit may have changed
+ */
+static int on_props_changed(struct sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	struct waiter *waiter = closure;
+
+	waiter->changed = 1;
+	return 0;
+}
+
+/*
+ * Current monotonic time in microseconds
+ */
+static uint64_t now_usec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static enum SysD_State unit_wait_stable(struct sd_bus *bus, int isuser, const char *dpath, const char *job, unsigned timeout_ms)
+{
+	int rc;
+	uint64_t deadline, now;
+	enum SysD_State state;
+	struct waiter waiter;
+	struct sd_bus_slot *sjob = NULL, *sprops = NULL;
+
+	/* install the signal handlers before reading states */
+	waiter.job = job;
+	waiter.changed = 1;
+	subscribe(bus, isuser);
+	rc = sd_bus_match_signal(bus, &sjob, signal_sender(bus), sdb_path, sdbi_manager,
+					sdbs_job_removed, on_job_removed, &waiter);
+	if (rc >= 0)
+		rc = sd_bus_match_signal(bus, &sprops, signal_sender(bus), dpath, sdbi_props,
+					sdbs_props_changed, on_props_changed, &waiter);
+	if (rc < 0) {
+		state = SysD_State_INVALID;
+		errno = -rc;
+		goto end;
+	}
+	if (waiter.job && !job_is_pending(bus, waiter.job))
+		waiter.job = NULL;
+
+	/* wait for a stable state */
+	deadline = now_usec() + (uint64_t)timeout_ms * 1000;
+	state = SysD_State_INVALID;
+	for (;;) {
+		/* check the state when needed */
+		if (!waiter.job && waiter.changed) {
+			waiter.changed = 0;
+			state = unit_state(bus, dpath);
+			switch (state) {
+			case SysD_State_Active:
+			case SysD_State_Failed:
+			case SysD_State_Inactive:
+				goto end;
+			default:
+				break;
+			}
+		}
+		/* process the pending messages */
+		rc = sd_bus_process(bus, NULL);
+		if (rc > 0)
+			continue;
+		if (rc < 0) {
+			errno = -rc;
+			break;
+		}
+		/* wait for messages */
+		now = now_usec();
+		if (now >= deadline) {
+			errno = ETIMEDOUT;
+			break;
+		}
+		rc = sd_bus_wait(bus, deadline - now);
+		if (rc < 0 && rc != -EINTR) {
+			errno = -rc;
+			break;
+		}
+	}
+end:
+	sd_bus_slot_unref(sjob);
+	sd_bus_slot_unref(sprops);
+	return state;
+}
+
+/********************************************************************
+ * Routines for starting units asynchronously
+ *******************************************************************/
+
+/*
+ * Records the state of an asynchronous start
+ */
+struct starter {
+	struct sd_bus *bus;		/* the bus */
+	char *dpath;			/* D-Bus path of the unit */
+	char *job;			/* D-Bus path of the job or NULL */
+	int starting;			/* is the start still pending? */
+	int reading;			/* is the state being read? */
+	int changed;			/* should the state be read again? */
+	struct sd_bus_slot *sjob;	/* match of JobRemoved */
+	struct sd_bus_slot *sprops;	/* match of PropertiesChanged */
+	struct sd_bus_slot *scall;	/* pending method call */
+	struct sd_event_source *timer;	/* timeout */
+	uint64_t *queued;		/* where to store the time of queuing or NULL */
+	void (*callback)(void *closure, enum SysD_State state);
+	void *closure;			/* closure of the callback */
+};
+
+/*
+ * Ends the asynchronous start of 'starter' with the 'state'
+ * and the error 'error' (an errno value when state is invalid).
+ */
+static void starter_end(struct starter *starter, enum SysD_State state, int error)
+{
+	sd_bus_slot_unref(starter->sjob);
+	sd_bus_slot_unref(starter->sprops);
+	sd_bus_slot_unref(starter->scall);
+	sd_event_source_unref(starter->timer);
+	errno = error;
+	starter->callback(starter->closure, state);
+	sd_bus_unref(starter->bus);
+	free(starter->job);
+	free(starter->dpath);
+	free(starter);
+}
+
+static void starter_read_state(struct starter *starter);
+
+/*
+ * Reply to the reading of the state of the unit
+ */
+static int on_starter_state(struct sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	struct starter *starter = closure;
+	enum SysD_State state;
+	const char *st;
+	int rc;
+
+	starter->scall = sd_bus_slot_unref(starter->scall);
+	starter->reading = 0;
+	rc = sd_bus_message_get_errno(msg);
+	if (rc == 0)
+		rc = -sd_bus_message_read(msg, "v", "s", &st);
+	if (rc > 0) {
+		starter_end(starter, SysD_State_INVALID, rc);
+		return 0;
+	}
+	state = systemd_state_of_name(st);
+	switch (state) {
+	case SysD_State_Active:
+	case SysD_State_Failed:
+	case SysD_State_Inactive:
+		starter_end(starter, state, 0);
+		break;
+	default:
+		if (starter->changed)
+			starter_read_state(starter);
+		break;
+	}
+	return 0;
+}
+
+/*
+ * Reads the state of the unit asynchronously, or when already
+ * reading, records to read it again.
+ */
+static void starter_read_state(struct starter *starter)
+{
+	int rc;
+
+	if (starter->reading)
+		starter->changed = 1;
+	else {
+		starter->changed = 0;
+		starter->reading = 1;
+		rc = sd_bus_call_method_async(starter->bus, &starter->scall, sdb_destination,
+					starter->dpath, sdbi_props, sdbm_get, on_starter_state,
+					starter, "ss", sdbi_unit, sdbp_active_state);
+		if (rc < 0)
+			starter_end(starter, SysD_State_INVALID, -rc);
+	}
+}
+
+/*
+ * Signal JobRemoved: reads the state when the job is removed
+ */
+static int on_starter_job_removed(struct sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	struct starter *starter = closure;
+	const char *job, *unit, *result;
+	uint32_t id;
+
+	if (starter->job
+	 && sd_bus_message_read(msg, "uoss", &id, &job, &unit, &result) >= 0
+	 && !strcmp(job, starter->job)) {
+		free(starter->job);
+		starter->job = NULL;
+		starter_read_state(starter);
+	}
+	return 0;
+}
+
+/*
+ * Signal PropertiesChanged: reads the state when no job is pending
+ */
+static int on_starter_props_changed(struct sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	struct starter *starter = closure;
+
+	if (!starter->starting && !starter->job)
+		starter_read_state(starter);
+	return 0;
+}
+
+/*
+ * Reply to the method Start: records the job to wait
+ */
+static int on_starter_started(struct sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	struct starter *starter = closure;
+	const char *job;
+	int rc;
+
+	starter->scall = sd_bus_slot_unref(starter->scall);
+	starter->starting = 0;
+	rc = sd_bus_message_get_errno(msg);
+	if (rc == 0)
+		rc = -sd_bus_message_read_basic(msg, 'o', &job);
+	if (rc == 0) {
+		starter->job = strdup(job);
+		if (starter->job == NULL)
+			rc = ENOMEM;
+		else if (starter->queued)
+			*starter->queued = now_usec();
+	}
+	if (rc > 0)
+		starter_end(starter, SysD_State_INVALID, rc);
+	return 0;
+}
+
+/*
+ * Timeout of the start
+ */
+static int on_starter_timeout(struct sd_event_source *source, uint64_t usec, void *closure)
+{
+	starter_end(closure, SysD_State_INVALID, ETIMEDOUT);
+	return 0;
+}
+
+static int unit_start_wait_async(struct sd_bus *bus, int isuser, const char *dpath, unsigned timeout_ms,
+			uint64_t *queued, void (*callback)(void *closure, enum SysD_State state), void *closure)
+{
+	struct starter *starter;
+	struct sd_event *event;
+	uint64_t now;
+	int rc;
+
+	/* asynchronous calls need an event loop */
+	event = sd_bus_get_event(bus);
+	if (event == NULL)
+		return seterrno(ENOTSUP);
+
+	/* create the starter */
+	starter = calloc(1, sizeof *starter);
+	if (starter == NULL)
+		return seterrno(ENOMEM);
+	starter->dpath = strdup(dpath);
+	if (starter->dpath == NULL) {
+		free(starter);
+		return seterrno(ENOMEM);
+	}
+	starter->bus = sd_bus_ref(bus);
+	starter->starting = 1;
+	starter->queued = queued;
+	starter->callback = callback;
+	starter->closure = closure;
+
+	/* install the signal handlers, the timer and start the unit */
+	subscribe(bus, isuser);
+	rc = sd_bus_match_signal(bus, &starter->sjob, signal_sender(bus), sdb_path, sdbi_manager,
+				sdbs_job_removed, on_starter_job_removed, starter);
+	if (rc >= 0)
+		rc = sd_bus_match_signal(bus, &starter->sprops, signal_sender(bus), dpath, sdbi_props,
+				sdbs_props_changed, on_starter_props_changed, starter);
+	if (rc >= 0)
+		rc = sd_event_now(event, CLOCK_MONOTONIC, &now);
+	if (rc >= 0)
+		rc = sd_event_add_time(event, &starter->timer, CLOCK_MONOTONIC,
+				now + (uint64_t)timeout_ms * 1000, 0, on_starter_timeout, starter);
+	if (rc >= 0)
+		rc = sd_bus_call_method_async(bus, &starter->scall, sdb_destination, dpath,
+				sdbi_unit, sdbm_start, on_starter_started, starter, "s", "replace");
+	if (rc < 0) {
+		/* don't call the callback */
+		sd_bus_slot_unref(starter->sjob);
+		sd_bus_slot_unref(starter->sprops);
+		sd_event_source_unref(starter->timer);
+		sd_bus_unref(starter->bus);
+		free(starter->dpath);
+		free(starter);
+		return seterrno(-rc);
+	}
+	return 0;
+}
+
+/********************************************************************
+ * Routines for reading pids of many units
+ *******************************************************************/
+
+/*
+ * Records a group of pipelined reads of pids
+ */
+struct pidsread {
+	unsigned pending;		/* count of pending reads and 1 while sending */
+	int *pids;			/* the pids read, -1 when not read */
+	void (*callback)(void *closure, const int pids[]);
+	void *closure;			/* closure of the callback */
+	struct pidread {
+		struct pidsread *group;	/* the group */
+		int *pid;		/* where to store the pid */
+	} items[];
+};
+
+/*
+ * Removes a pending read of 'prs', calling the callback after the last one
+ */
+static void pids_unref(struct pidsread *prs)
+{
+	if (--prs->pending == 0) {
+		prs->callback(prs->closure, prs->pids);
+		free(prs);
+	}
+}
+
+/*
+ * Reply to the reading of ExecMainPID
+ */
+static int on_pid_read(struct sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	struct pidread *pr = closure;
+	uint32_t u;
+
+	if (sd_bus_message_get_errno(msg) == 0
+	 && sd_bus_message_read(msg, "v", "u", &u) >= 0)
+		*pr->pid = (int)u;
+	pids_unref(pr->group);
+	return 0;
+}
+
+/*
+ * Reads the pids of the units of 'dpaths' with pipelined calls whose
+ * replies are dispatched by the event loop of 'bus'. The bus is never
+ * processed here. Without event loop, the pids are read one by one.
+ */
+static int units_pid_async(struct sd_bus *bus, unsigned count, const char * const dpaths[],
+			void (*callback)(void *closure, const int pids[]), void *closure)
+{
+	struct pidsread *prs;
+	unsigned idx;
+	int rc;
+
+	prs = malloc(sizeof *prs + count * (sizeof *prs->items + sizeof *prs->pids));
+	if (prs == NULL)
+		return seterrno(ENOMEM);
+	prs->pids = (int*)&prs->items[count];
+	prs->callback = callback;
+	prs->closure = closure;
+	prs->pending = 1;
+
+	/* send all the requests */
+	for (idx = 0 ; idx < count ; idx++) {
+		prs->pids[idx] = -1;
+		prs->items[idx].group = prs;
+		prs->items[idx].pid = &prs->pids[idx];
+		if (sd_bus_get_event(bus) == NULL) {
+			rc = unit_pid(bus, dpaths[idx]);
+			if (rc >= 0)
+				prs->pids[idx] = rc;
+		}
+		else {
+			rc = sd_bus_call_method_async(bus, NULL, sdb_destination, dpaths[idx],
+					sdbi_props, sdbm_get, on_pid_read, &prs->items[idx],
+					"ss", sdbi_service, sdbp_exec_main_pid);
+			if (rc >= 0)
+				prs->pending++;
+		}
+	}
+	pids_unref(prs);
+	return 0;
+}
+
+/********************************************************************
+ * Routines for watching the states of units
+ *******************************************************************/
+
+/* match of the changes of units, without sender for direct connections */
+#define UNITS_MATCH \
+	"type='signal'," \
+	"interface='org.freedesktop.DBus.Properties'," \
+	"member='PropertiesChanged'," \
+	"path_namespace='/org/freedesktop/systemd1/unit'," \
+	"arg0='org.freedesktop.systemd1.Unit'"
+
+static const char units_match[] = "sender='org.freedesktop.systemd1'," UNITS_MATCH;
+static const char units_match_direct[] = UNITS_MATCH;
+
+/*
+ * Records a watcher of units
+ */
+struct units_watcher {
+	int isuser;
+	char *dprefix;		/* prefix of the D-Bus paths of the watched units or NULL */
+	size_t dprefixlen;	/* length of the prefix */
+	void (*callback)(void *closure, int isuser, const char *dpath, enum SysD_State state);
+	void *closure;
+};
+
+/*
+ * Signal PropertiesChanged of units: searches ActiveState in the
+ * changed properties and reports it
+ */
+static int on_units_props_changed(struct sd_bus_message *msg, void *closure, sd_bus_error *error)
+{
+	struct units_watcher *watcher = closure;
+	const char *iface, *name, *value, *path;
+	int rc;
+
+	/* ignore the units not watched before reading anything */
+	path = sd_bus_message_get_path(msg);
+	if (watcher->dprefix != NULL
+	 && (path == NULL || strncmp(path, watcher->dprefix, watcher->dprefixlen)))
+		return 0;
+
+	rc = sd_bus_message_read(msg, "s", &iface);
+	if (rc >= 0)
+		rc = sd_bus_message_enter_container(msg, SD_BUS_TYPE_ARRAY, "{sv}");
+	while (rc > 0) {
+		rc = sd_bus_message_enter_container(msg, SD_BUS_TYPE_DICT_ENTRY, "sv");
+		if (rc > 0) {
+			rc = sd_bus_message_read(msg, "s", &name);
+			if (rc >= 0 && !strcmp(name, sdbp_active_state)) {
+				if (sd_bus_message_read(msg, "v", "s", &value) >= 0)
+					watcher->callback(watcher->closure, watcher->isuser,
+						path, systemd_state_of_name(value));
+				break;
+			}
+			if (rc >= 0)
+				rc = sd_bus_message_skip(msg, "v");
+			if (rc >= 0)
+				rc = sd_bus_message_exit_container(msg);
+		}
+	}
+	return 0;
+}
+
+static int watch_units(struct sd_bus *bus, int isuser, const char *prefix,
+		void (*callback)(void *closure, int isuser, const char *dpath, enum SysD_State state), void *closure)
+{
+	struct units_watcher *watcher;
+	char *dprefix;
+	int rc;
+
+	/* signals are only dispatched by an event loop */
+	if (sd_bus_get_event(bus) == NULL)
+		return seterrno(ENOTSUP);
+
+	/* the prefix of names is escaped as in D-Bus paths */
+	dprefix = NULL;
+	if (prefix != NULL && (dprefix = systemd_unit_dpath_of_name(prefix)) == NULL)
+		return -1;
+
+	watcher = malloc(sizeof *watcher);
+	if (watcher == NULL) {
+		free(dprefix);
+		return seterrno(ENOMEM);
+	}
+	watcher->isuser = isuser;
+	watcher->dprefix = dprefix;
+	watcher->dprefixlen = dprefix ? strlen(dprefix) : 0;
+	watcher->callback = callback;
+	watcher->closure = closure;
+
+	/* the match is floating, it lives as long as the bus */
+	subscribe(bus, isuser);
+	rc = sd_bus_add_match(bus, NULL, signal_sender(bus) ? units_match : units_match_direct,
+				on_units_props_changed, watcher);
+	if (rc < 0) {
+		free(dprefix);
+		free(watcher);
+		return seterrno(-rc);
+	}
+	return 0;
+}
+#endif
+
 /********************************************************************
  *
  *******************************************************************/
@@ -429,6 +1171,71 @@ char *systemd_unit_dpath_by_name(int isuser, const char *name, int load)
 	return systemd_get_bus(isuser, &bus) < 0 ? NULL : get_unit_dpath(bus, name, load);
 }
 
+char *systemd_unit_dpath_of_name(const char *name)
+{
+	size_t len;
+	char *dpath;
+
+	len = sizeof sdb_unit_path + 3 * strlen(name) + 1;
+	dpath = malloc(len);
+	if (dpath == NULL)
+		errno = ENOMEM;
+	else {
+		memcpy(dpath, sdb_unit_path, sizeof sdb_unit_path - 1);
+		dpath[sizeof sdb_unit_path - 1] = '/';
+		if (unit_escape_for_path(&dpath[sizeof sdb_unit_path], len - sizeof sdb_unit_path, name) < 0) {
+			free(dpath);
+			dpath = NULL;
+		}
+	}
+	return dpath;
+}
+
+static int h2d(char c)
+{
+	return c >= '0' && c <= '9' ? c - '0'
+		: c >= 'a' && c <= 'f' ? c - 'a' + 10
+		: c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+char *systemd_unit_name_of_dpath(const char *dpath)
+{
+	size_t r, w;
+	int hi, lo;
+	char *name;
+
+	/* check the prefix */
+	if (strncmp(dpath, sdb_unit_path, sizeof sdb_unit_path - 1)
+	 || dpath[sizeof sdb_unit_path - 1] != '/')
+		goto inval;
+	dpath += sizeof sdb_unit_path;
+
+	/* unescape */
+	name = malloc(strlen(dpath) + 1);
+	if (name == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	for (r = w = 0 ; dpath[r] ; w++) {
+		if (dpath[r] != '_')
+			name[w] = dpath[r++];
+		else if ((hi = h2d(dpath[r + 1])) >= 0 && (lo = h2d(dpath[r + 2])) >= 0) {
+			name[w] = (char)(hi << 4 | lo);
+			r += 3;
+		}
+		else {
+			free(name);
+			goto inval;
+		}
+	}
+	name[w] = 0;
+	return name;
+
+inval:
+	errno = EINVAL;
+	return NULL;
+}
+
 char *systemd_unit_dpath_by_pid(int isuser, unsigned pid)
 {
 	struct sd_bus *bus;
@@ -463,6 +1270,24 @@ int systemd_unit_stop_dpath(int isuser, const char *dpath, char **job)
 	return rc < 0 ? rc : unit_stop(bus, dpath, job);
 }
 
+int systemd_unit_freeze_dpath(int isuser, const char *dpath)
+{
+	int rc;
+	struct sd_bus *bus;
+
+	rc = systemd_get_bus(isuser, &bus);
+	return rc < 0 ? rc : unit_freeze(bus, dpath, 1);
+}
+
+int systemd_unit_thaw_dpath(int isuser, const char *dpath)
+{
+	int rc;
+	struct sd_bus *bus;
+
+	rc = systemd_get_bus(isuser, &bus);
+	return rc < 0 ? rc : unit_freeze(bus, dpath, 0);
+}
+
 int systemd_unit_start_name(int isuser, const char *name, char **job)
 {
 	int rc;
@@ -515,6 +1340,32 @@ int systemd_unit_stop_pid(int isuser, unsigned pid, char **job)
 	return rc;
 }
 
+enum SysD_State systemd_unit_wait_stable(int isuser, const char *dpath, const char *job, unsigned timeout_ms)
+{
+#if !NO_LIBSYSTEMD
+	struct sd_bus *bus;
+
+	return systemd_get_bus(isuser, &bus) < 0 ? SysD_State_INVALID
+			: unit_wait_stable(bus, isuser, dpath, job, timeout_ms);
+#else
+	errno = ENOTSUP;
+	return SysD_State_INVALID;
+#endif
+}
+
+int systemd_unit_start_wait_async(int isuser, const char *dpath, unsigned timeout_ms,
+			uint64_t *queued, void (*callback)(void *closure, enum SysD_State state), void *closure)
+{
+#if !NO_LIBSYSTEMD
+	struct sd_bus *bus;
+
+	return systemd_get_bus(isuser, &bus) < 0 ? -1
+			: unit_start_wait_async(bus, isuser, dpath, timeout_ms, queued, callback, closure);
+#else
+	return seterrno(ENOTSUP);
+#endif
+}
+
 int systemd_unit_pid_of_dpath(int isuser, const char *dpath)
 {
 	int rc;
@@ -524,6 +1375,28 @@ int systemd_unit_pid_of_dpath(int isuser, const char *dpath)
 	return rc < 0 ? rc : unit_pid(bus, dpath);
 }
 
+int systemd_units_pid_of_dpaths_async(int isuser, unsigned count, const char * const dpaths[],
+			void (*callback)(void *closure, const int pids[]), void *closure)
+{
+#if !NO_LIBSYSTEMD
+	struct sd_bus *bus;
+
+	return systemd_get_bus(isuser, &bus) < 0 ? -1
+			: units_pid_async(bus, count, dpaths, callback, closure);
+#else
+	return seterrno(ENOTSUP);
+#endif
+}
+
+int systemd_unit_is_frozen_dpath(int isuser, const char *dpath)
+{
+	int rc;
+	struct sd_bus *bus;
+
+	rc = systemd_get_bus(isuser, &bus);
+	return rc < 0 ? rc : unit_is_frozen(bus, dpath);
+}
+
 enum SysD_State systemd_unit_state_of_dpath(int isuser, const char *dpath)
 {
 	int rc;
@@ -533,6 +1406,18 @@ enum SysD_State systemd_unit_state_of_dpath(int isuser, const char *dpath)
 	return rc < 0 ? SysD_State_INVALID : unit_state(bus, dpath);
 }
 
+int systemd_watch_units(int isuser, const char *prefix,
+		void (*callback)(void *closure, int isuser, const char *dpath, enum SysD_State state), void *closure)
+{
+#if !NO_LIBSYSTEMD
+	struct sd_bus *bus;
+
+	return systemd_get_bus(isuser, &bus) < 0 ? -1 : watch_units(bus, isuser, prefix, callback, closure);
+#else
+	return seterrno(ENOTSUP);
+#endif
+}
+
 const char *systemd_name_of_state(enum SysD_State state)
 {
 	return sds_state_names[state >= 0 && state < sizeof sds_state_names / sizeof *sds_state_names ? state : SysD_State_INVALID];
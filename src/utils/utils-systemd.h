@@ -24,6 +24,8 @@
 
 #pragma once
 
+#include <stdint.h>
+
 enum SysD_State {
     SysD_State_INVALID,
     SysD_State_Inactive,
@@ -70,8 +72,16 @@ struct SysD_ListUnitItem
 	const char *job_opath;
 };
 
+/**
+ * Value of the parameter 'isuser' selecting the bus of the user 'uid'.
+ * Connections to buses of users are pooled and closed when idle.
+ * The value 1 selects the user bus of the process.
+ */
+#define SYSTEMD_ISUSER_UID(uid) ((uid) >= 0 ? 2 + (uid) : 1)
+
 struct sd_bus;
 extern int systemd_get_bus(int isuser, struct sd_bus **ret);
+/* set the bus to use, a reference is taken, NULL resets to the default */
 extern void systemd_set_bus(int isuser, struct sd_bus *bus);
 
 extern int systemd_daemon_reload(int isuser);
@@ -79,22 +89,123 @@ extern int systemd_daemon_reload(int isuser);
 extern char *systemd_unit_dpath_by_name(int isuser, const char *name, int load);
 extern char *systemd_unit_dpath_by_pid(int isuser, unsigned pid);
 
+/**
+ * Computes locally, without calling systemd, the D-Bus path of the
+ * unit of 'name'. The unit is not loaded but systemd loads it on
+ * the first access to the path.
+ *
+ * @param name the name of the unit
+ *
+ * @return the path to be freed by the caller or NULL with errno set
+ */
+extern char *systemd_unit_dpath_of_name(const char *name);
+
+/**
+ * Computes locally the name of the unit of D-Bus path 'dpath'.
+ * It is the reverse of systemd_unit_dpath_of_name.
+ *
+ * @param dpath the D-Bus path of the unit
+ *
+ * @return the name to be freed by the caller or NULL with errno set
+ */
+extern char *systemd_unit_name_of_dpath(const char *dpath);
+
 extern int systemd_unit_start_dpath(int isuser, const char *dpath, char **job);
 extern int systemd_unit_restart_dpath(int isuser, const char *dpath, char **job);
 extern int systemd_unit_stop_dpath(int isuser, const char *dpath, char **job);
 
+/* freeze (suspend) or thaw (resume) the processes of the unit using the cgroup freezer */
+extern int systemd_unit_freeze_dpath(int isuser, const char *dpath);
+extern int systemd_unit_thaw_dpath(int isuser, const char *dpath);
+
 extern int systemd_unit_start_name(int isuser, const char *name, char **job);
 extern int systemd_unit_restart_name(int isuser, const char *name, char **job);
 extern int systemd_unit_stop_name(int isuser, const char *name, char **job);
 extern int systemd_unit_stop_pid(int isuser, unsigned pid, char **job);
 
 extern int systemd_unit_pid_of_dpath(int isuser, const char *dpath);
+
+/* returns 1 if the unit is frozen, 0 if not or -1 on error */
+extern int systemd_unit_is_frozen_dpath(int isuser, const char *dpath);
+
+/**
+ * Reads asynchronously the main pids of the units of 'dpaths' using
+ * pipelined calls and calls 'callback' with the pids when all the
+ * replies are received. The replies are dispatched by the event loop
+ * of the bus; without event loop, the pids are read one by one and
+ * the callback is called before returning.
+ *
+ * @param isuser   is units of systemd user (not zero) or system (zero)?
+ * @param count    count of units
+ * @param dpaths   D-Bus paths of the units
+ * @param callback function called with the array of the pids,
+ *                 -1 when not read, valid only during the call
+ * @param closure  closure to give to the callback
+ *
+ * @return 0 when the callback is or will be called or -1 with errno
+ * set on error, the callback will not be called
+ */
+extern int systemd_units_pid_of_dpaths_async(int isuser, unsigned count, const char * const dpaths[],
+			void (*callback)(void *closure, const int pids[]), void *closure);
 extern enum SysD_State systemd_unit_state_of_dpath(int isuser, const char *dpath);
 extern const char *systemd_name_of_state(enum SysD_State state);
 extern enum SysD_State systemd_state_of_name(const char *name);
 
 extern int systemd_job_is_pending(int isuser, const char *job);
 
+/**
+ * Waits until the 'job' (if not NULL) is done and the unit of 'dpath'
+ * reached a stable state: active, inactive or failed.
+ * The wait is driven by the signals of systemd.
+ *
+ * @param isuser     is units of systemd user (not zero) or system (zero)?
+ * @param dpath      D-Bus path of the unit
+ * @param job        D-Bus path of the job to wait or NULL
+ * @param timeout_ms maximum time to wait in milliseconds
+ *
+ * @return the stable state or SysD_State_INVALID with errno set
+ * (ETIMEDOUT when timeout expired)
+ */
+extern enum SysD_State systemd_unit_wait_stable(int isuser, const char *dpath, const char *job, unsigned timeout_ms);
+
+/**
+ * Starts asynchronously the unit of 'dpath' and calls 'callback' when
+ * its start job is done and its state is stable: active, inactive or
+ * failed. On error or timeout, the callback receives SysD_State_INVALID
+ * and errno is set. The bus must be attached to an event loop.
+ *
+ * @param isuser     is units of systemd user (not zero) or system (zero)?
+ * @param dpath      D-Bus path of the unit
+ * @param timeout_ms maximum time to wait in milliseconds
+ * @param queued     if not NULL, where to store the monotonic time in
+ *                   microseconds when the start job is queued
+ * @param callback   function called with the state of the unit
+ * @param closure    closure to give to the callback
+ *
+ * @return 0 when started, the callback will be called, or -1 with errno
+ * set when the start failed, the callback will not be called (ENOTSUP
+ * when the bus is not attached to an event loop).
+ */
+extern int systemd_unit_start_wait_async(int isuser, const char *dpath, unsigned timeout_ms,
+			uint64_t *queued, void (*callback)(void *closure, enum SysD_State state), void *closure);
+
+/**
+ * Watches the changes of the active state of the units. The callback
+ * receives the D-Bus path of the unit and its new state. The bus must
+ * be attached to an event loop. The changes of units whose names don't
+ * start with 'prefix' are dropped before being decoded.
+ *
+ * @param isuser   is units of systemd user (not zero) or system (zero)?
+ * @param prefix   prefix of the names of the watched units or NULL for all
+ * @param callback function called for each change
+ * @param closure  closure to give to the callback
+ *
+ * @return 0 on success or -1 with errno set (ENOTSUP when the bus is
+ * not attached to an event loop)
+ */
+extern int systemd_watch_units(int isuser, const char *prefix,
+		void (*callback)(void *closure, int isuser, const char *dpath, enum SysD_State state), void *closure);
+
 /**
  * Retrieves the units of the given pattern and activates the callback for each of them.
  *